@@ -0,0 +1,145 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <time.h>
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/cja142/mountdir"
+
+#define BLOCKSIZE 4096
+#define ITERS_LARGE 2048
+#define RANDOM_READS 1000
+#define FILEPERM 0666
+#define DIND_BLOCK (16 + 7*1024)	/* first block of a pointer mapped file under indirect_ptr[7] */
+#define DIND_SPAN 8					/* blocks written on each side of DIND_BLOCK */
+
+char buf[BLOCKSIZE];
+
+static unsigned long long elapsed_ms(struct timeval *start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (1000ULL * (now.tv_sec - start->tv_sec)) + ((now.tv_usec - start->tv_usec) / 1000);
+}
+
+int main(int argc, char **argv) {
+	struct timeval tm;
+	int i, fd = 0;
+	struct stat st;
+
+	/* TEST 1: Large file sequential write, goes through the indirect blocks */
+	if ((fd = creat(TESTDIR "/largefile", FILEPERM)) < 0) {
+		perror("creat");
+		printf("TEST 1: Large file create failure \n");
+		exit(1);
+	}
+
+	gettimeofday(&tm, NULL);
+	for (i = 0; i < ITERS_LARGE; i++) {
+		memset(buf, 0x61 + i % 26, BLOCKSIZE);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 1: Large file write failure at block %d \n", i);
+			exit(1);
+		}
+	}
+
+	fstat(fd, &st);
+	if (st.st_size != (off_t)ITERS_LARGE*BLOCKSIZE) {
+		printf("TEST 1: Large file write failure %lld != %d \n", (long long)st.st_size, ITERS_LARGE*BLOCKSIZE);
+		exit(1);
+	}
+	close(fd);
+	printf("TEST 1: Large file write success in %llu ms \n", elapsed_ms(&tm));
+
+
+	/* TEST 2: Large file sequential read */
+	if ((fd = open(TESTDIR "/largefile", O_RDONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	gettimeofday(&tm, NULL);
+	for (i = 0; i < ITERS_LARGE; i++) {
+		if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE || buf[0] != 0x61 + i % 26 || buf[BLOCKSIZE-1] != 0x61 + i % 26) {
+			printf("TEST 2: Large file read failure at block %d \n", i);
+			exit(1);
+		}
+	}
+	printf("TEST 2: Large file sequential read success in %llu ms \n", elapsed_ms(&tm));
+
+
+	/* TEST 3: Large file random read */
+	srand(416);
+	gettimeofday(&tm, NULL);
+	for (i = 0; i < RANDOM_READS; i++) {
+		int blk = rand() % ITERS_LARGE;
+		if (pread(fd, buf, BLOCKSIZE, (off_t)blk*BLOCKSIZE) != BLOCKSIZE || buf[0] != 0x61 + blk % 26) {
+			printf("TEST 3: Large file random read failure at block %d \n", blk);
+			exit(1);
+		}
+	}
+	printf("TEST 3: Large file random read success in %llu ms \n", elapsed_ms(&tm));
+	close(fd);
+
+
+	/* TEST 4: Large file remove */
+	if (unlink(TESTDIR "/largefile") < 0) {
+		perror("unlink");
+		printf("TEST 4: Large file unlink failure \n");
+		exit(1);
+	}
+	printf("TEST 4: Large file unlink success \n");
+
+
+	/* TEST 5: Sparse file across the double indirect boundary; with a USE_EXTENTS 0 build of tfs
+	 * this maps blocks through the last single indirect block and through indirect_ptr[7] */
+	if ((fd = open(TESTDIR "/sparsefile", O_RDWR | O_CREAT | O_TRUNC, FILEPERM)) < 0) {
+		perror("open");
+		printf("TEST 5: Sparse file create failure \n");
+		exit(1);
+	}
+
+	gettimeofday(&tm, NULL);
+	for (i = DIND_BLOCK - DIND_SPAN; i < DIND_BLOCK + DIND_SPAN; i++) {
+		memset(buf, 0x61 + i % 26, BLOCKSIZE);
+		*(int *)buf = i;
+		if (pwrite(fd, buf, BLOCKSIZE, (off_t)i*BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 5: Sparse file write failure at block %d \n", i);
+			exit(1);
+		}
+	}
+	close(fd);
+
+	if ((fd = open(TESTDIR "/sparsefile", O_RDONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	for (i = DIND_BLOCK - DIND_SPAN; i < DIND_BLOCK + DIND_SPAN; i++) {
+		if (pread(fd, buf, BLOCKSIZE, (off_t)i*BLOCKSIZE) != BLOCKSIZE || *(int *)buf != i ||
+				buf[BLOCKSIZE-1] != 0x61 + i % 26) {
+			printf("TEST 5: Sparse file read failure at block %d \n", i);
+			exit(1);
+		}
+	}
+	/* the hole before the written blocks reads back as zeros */
+	if (pread(fd, buf, BLOCKSIZE, (off_t)(DIND_BLOCK - DIND_SPAN - 1)*BLOCKSIZE) != BLOCKSIZE ||
+			buf[0] != 0 || buf[BLOCKSIZE-1] != 0) {
+		printf("TEST 5: Sparse file hole read failure \n");
+		exit(1);
+	}
+	close(fd);
+	if (unlink(TESTDIR "/sparsefile") < 0) {
+		perror("unlink");
+		printf("TEST 5: Sparse file unlink failure \n");
+		exit(1);
+	}
+	printf("TEST 5: Sparse file across the double indirect boundary success in %llu ms \n", elapsed_ms(&tm));
+
+	printf("Benchmark completed \n");
+	return 0;
+}
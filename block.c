@@ -1,19 +1,30 @@
 /*
  *  Copyright (C) 2021 CS416 Rutgers CS
- *	
+ *
  *	Tiny File System
  *
  *	File:	block.c
  *
  */
 
+#define _GNU_SOURCE				//O_DIRECT
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE		//linux/fs.h has its own, ours comes from block.h
 
 #include "block.h"
 
@@ -21,20 +32,1061 @@
 #define DISK_SIZE	32*1024*1024
 
 int diskfile = -1;
+static int devmode = DEV_PREAD;
+
+/*
+ * Memory-mapped device: in DEV_MMAP mode the whole DISKFILE is mapped shared
+ * and bio_read()/bio_write() are plain copies to and from the mapping. The
+ * kernel page cache is the only cache, dirty pages go out on msync().
+ */
+static char *dmap;
+
+/*
+ * Aligned buffer pool: O_DIRECT transfers need buffers aligned to the block
+ * size. bio_buf_get() hands out BLOCK_SIZE buffers aligned like the block
+ * cache, and bio_buf_put() keeps up to BIO_BUF_POOL of them for reuse.
+ */
+static void *buf_pool[BIO_BUF_POOL];
+static int buf_nfree;
+static pthread_mutex_t buf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Batched device I/O: bio_submit() and cache writeback hand a list of block
+ * requests to dev_rw(), which sorts them and merges consecutive blocks into
+ * runs of up to BIO_MAX_RUN blocks, each moved with a single preadv/pwritev.
+ * Up to BIO_QUEUE_DEPTH runs are kept in flight on an io_uring. If the kernel
+ * has no io_uring, BIO_THREADS worker threads run them instead.
+ */
+struct bio_run {
+	struct bio_req **reqs;			/* requests for consecutive blocks, in block order */
+	struct iovec *iov;				/* their buffers */
+	int n;
+};
+
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_bytes, cq_bytes, sqes_bytes;
+};
+
+static struct uring ring = { .fd = -1 };
+
+static pthread_t workers[BIO_THREADS];
+static int nworkers;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static struct bio_run *pool_runs;
+static int pool_next, pool_count, pool_left, pool_stop;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;	/* one batch on the ring or pool at a time */
+
+//Run one request with pread/pwrite, failed or short reads leave zeros behind
+static void block_pio(struct bio_req *r) {
+	off_t off = (off_t)r->block_num*BLOCK_SIZE;
+	if (r->write) {
+		r->res = pwrite(diskfile, r->buf, BLOCK_SIZE, off);
+		if (r->res < 0)
+			perror("block_write failed");
+		return;
+	}
+	r->res = pread(diskfile, r->buf, BLOCK_SIZE, off);
+	if (r->res < 0)
+		perror("block_read failed");
+	if (r->res < BLOCK_SIZE)
+		memset((char*)r->buf + (r->res > 0 ? r->res : 0), 0, BLOCK_SIZE - (r->res > 0 ? r->res : 0));
+}
+
+//Hand out the bytes moved by a run to its requests, blocks it did not reach are retried alone
+static void run_done(struct bio_run *run, ssize_t ret) {
+	for (int i = 0; i < run->n; i++) {
+		if (ret >= (ssize_t)(i + 1)*BLOCK_SIZE) run->reqs[i]->res = BLOCK_SIZE;
+		else block_pio(run->reqs[i]);
+	}
+}
+
+static void dev_pio(struct bio_run *run) {
+	off_t off = (off_t)run->reqs[0]->block_num*BLOCK_SIZE;
+	if (run->reqs[0]->write) run_done(run, pwritev(diskfile, run->iov, run->n, off));
+	else run_done(run, preadv(diskfile, run->iov, run->n, off));
+}
+
+static int uring_init() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, BIO_QUEUE_DEPTH, &p);
+	if (fd < 0) {
+		return -1;
+	}
+	ring.sq_bytes = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	ring.cq_bytes = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_bytes > ring.sq_bytes) ring.sq_bytes = ring.cq_bytes;
+		ring.cq_bytes = ring.sq_bytes;
+	}
+	ring.sq_ring = mmap(NULL, ring.sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) ring.cq_ring = ring.sq_ring;
+	else ring.cq_ring = mmap(NULL, ring.cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring.sqes_bytes = p.sq_entries*sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		if (ring.sq_ring != MAP_FAILED) munmap(ring.sq_ring, ring.sq_bytes);
+		if (ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring) munmap(ring.cq_ring, ring.cq_bytes);
+		if (ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.sqes_bytes);
+		close(fd);
+		return -1;
+	}
+	char *sq = ring.sq_ring, *cq = ring.cq_ring;
+	ring.sq_head = (unsigned*)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+	ring.cq_head = (unsigned*)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	ring.entries = p.sq_entries < BIO_QUEUE_DEPTH ? p.sq_entries : BIO_QUEUE_DEPTH;
+	ring.fd = fd;
+	return 0;
+}
+
+static void uring_free() {
+	if (ring.fd < 0) {
+		return;
+	}
+	munmap(ring.sqes, ring.sqes_bytes);
+	if (ring.cq_ring != ring.sq_ring) munmap(ring.cq_ring, ring.cq_bytes);
+	munmap(ring.sq_ring, ring.sq_bytes);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+//Queue up to ring.entries runs, submit them with one system call and reap them all
+static int uring_rw(struct bio_run *runs, int n) {
+	for (int first = 0; first < n; first += ring.entries) {
+		int count = n - first < (int)ring.entries ? n - first : (int)ring.entries;
+		unsigned tail = *ring.sq_tail;
+		for (int k = 0; k < count; k++) {
+			struct bio_run *run = &runs[first + k];
+			unsigned idx = tail & *ring.sq_mask;
+			struct io_uring_sqe *sqe = &ring.sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = run->reqs[0]->write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = diskfile;
+			sqe->off = (off_t)run->reqs[0]->block_num*BLOCK_SIZE;
+			sqe->addr = (unsigned long)run->iov;
+			sqe->len = run->n;
+			sqe->user_data = first + k;
+			ring.sq_array[idx] = idx;
+			tail++;
+		}
+		__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+		int submitted = 0, reaped = 0;
+		while (reaped < count) {
+			int ret = syscall(__NR_io_uring_enter, ring.fd, count - submitted, count - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret < 0) {
+				if (errno != EINTR) {
+					perror("io_uring_enter failed");
+					return -1;
+				}
+				ret = 0;
+			}
+			submitted += ret;
+			unsigned head = *ring.cq_head;
+			while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+				struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+				// failed or short runs are redone block by block, as bio_read/bio_write would
+				run_done(&runs[cqe->user_data], cqe->res);
+				head++;
+				reaped++;
+			}
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		}
+	}
+	return 0;
+}
+
+static void *pool_worker(void *arg) {
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (!pool_stop && pool_next == pool_count) pthread_cond_wait(&pool_work, &pool_lock);
+		if (pool_stop) break;
+		struct bio_run *run = &pool_runs[pool_next++];
+		pthread_mutex_unlock(&pool_lock);
+		dev_pio(run);
+		pthread_mutex_lock(&pool_lock);
+		if (--pool_left == 0) pthread_cond_signal(&pool_done);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+
+static void pool_init() {
+	pool_stop = 0;
+	pool_next = pool_count = 0;
+	for (nworkers = 0; nworkers < BIO_THREADS; nworkers++) {
+		if (pthread_create(&workers[nworkers], NULL, pool_worker, NULL) != 0) break;
+	}
+}
+
+static void pool_free() {
+	pthread_mutex_lock(&pool_lock);
+	pool_stop = 1;
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+	for (int i = 0; i < nworkers; i++) pthread_join(workers[i], NULL);
+	nworkers = 0;
+}
+
+//Hand the runs to the worker threads and wait until they have moved them all
+static void pool_rw(struct bio_run *runs, int n) {
+	pthread_mutex_lock(&pool_lock);
+	pool_runs = runs;
+	pool_next = 0;
+	pool_count = pool_left = n;
+	pthread_cond_broadcast(&pool_work);
+	while (pool_left > 0) pthread_cond_wait(&pool_done, &pool_lock);
+	pool_next = pool_count = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+//Start the io_uring, or the worker threads if it cannot be set up
+static void queue_init() {
+	if (uring_init() < 0) pool_init();
+}
+
+static void queue_free() {
+	uring_free();
+	pool_free();
+}
+
+static int unaligned(const void *buf) {
+	return ((uintptr_t)buf & (BLOCK_SIZE - 1)) != 0;
+}
+
+static int req_cmp(const void *a, const void *b) {
+	const struct bio_req *x = *(struct bio_req**)a, *y = *(struct bio_req**)b;
+	if (x->block_num != y->block_num) return x->block_num - y->block_num;
+	return (x > y) - (x < y);
+}
+
+//Run a list of block requests against the disk file, merged into runs and several at a time
+static void dev_rw(struct bio_req *reqs, int n) {
+	if (n <= 0) {
+		return;
+	}
+	//Step 1: with O_DIRECT, requests on unaligned buffers go through a pool buffer
+	void **user = NULL;
+	if (devmode == DEV_DIRECT) {
+		user = malloc(n * sizeof(void*));
+		for (int i = 0; i < n; i++) {
+			user[i] = reqs[i].buf;
+			if (!unaligned(user[i])) continue;
+			reqs[i].buf = bio_buf_get();
+			if (reqs[i].write) memcpy(reqs[i].buf, user[i], BLOCK_SIZE);
+		}
+	}
+	//Step 2: sort the requests by block and cut them into runs of consecutive blocks
+	struct bio_req **order = malloc(n * sizeof(struct bio_req*));
+	struct iovec *iov = malloc(n * sizeof(struct iovec));
+	struct bio_run *runs = malloc(n * sizeof(struct bio_run));
+	for (int i = 0; i < n; i++) order[i] = &reqs[i];
+	qsort(order, n, sizeof(struct bio_req*), req_cmp);
+	int nruns = 0;
+	for (int i = 0; i < n; i++) {
+		iov[i].iov_base = order[i]->buf;
+		iov[i].iov_len = BLOCK_SIZE;
+		struct bio_run *last = nruns > 0 ? &runs[nruns - 1] : NULL;
+		if (last != NULL && last->n < BIO_MAX_RUN && last->reqs[0]->write == order[i]->write
+				&& last->reqs[last->n - 1]->block_num + 1 == order[i]->block_num) {
+			last->n++;
+			continue;
+		}
+		runs[nruns].reqs = &order[i];
+		runs[nruns].iov = &iov[i];
+		runs[nruns].n = 1;
+		nruns++;
+	}
+	//Step 3: move the runs, on the ring or the worker threads when there is more than one
+	if (nruns == 1 || (ring.fd < 0 && nworkers == 0)) {
+		for (int i = 0; i < nruns; i++) dev_pio(&runs[i]);
+	}
+	else {
+		pthread_mutex_lock(&queue_lock);
+		if (ring.fd >= 0 && uring_rw(runs, nruns) < 0) {
+			// the ring is broken, use the worker threads from now on
+			uring_free();
+			pool_init();
+		}
+		if (ring.fd < 0) pool_rw(runs, nruns);
+		pthread_mutex_unlock(&queue_lock);
+	}
+	if (user != NULL) {
+		for (int i = 0; i < n; i++) {
+			if (reqs[i].buf == user[i]) continue;
+			if (!reqs[i].write) memcpy(user[i], reqs[i].buf, BLOCK_SIZE);
+			bio_buf_put(reqs[i].buf);
+			reqs[i].buf = user[i];
+		}
+		free(user);
+	}
+	free(runs);
+	free(iov);
+	free(order);
+}
+
+
+/*
+ * Block buffer cache
+ *
+ * Every bio_read()/bio_write() goes through a fixed pool of BLOCK_SIZE
+ * buffers hashed by block number. Writes only dirty the buffer; dirty
+ * buffers reach the disk when they are evicted, when they are older than
+ * BCACHE_DIRTY_AGE, or when bio_flush() is called. Eviction uses CLOCK.
+ * A missing block is read without bcache_lock into a busy buffer, which is
+ * not evicted, and which any other reader treats as a miss. Up to half of the
+ * buffers are busy at a time. Held buffers are not evicted before their
+ * commit either; when nothing else can go, a read is not cached, a plain
+ * write goes straight to the disk, and bio_write_meta() fails with -ENOMEM.
+ */
+struct bcache_buf {
+	int block_num;					/* cached block, -1 if the slot is free */
+	int dirty;						/* block differs from the disk copy */
+	int ref;						/* CLOCK reference bit */
+	int held;						/* metadata waiting for bio_commit(), not written in place before */
+	int busy;						/* being read from the disk without bcache_lock, no data yet */
+	unsigned long gen;				/* bcache_gen when the buffer last got new contents */
+	time_t dirtied;					/* time the buffer became dirty */
+	struct bcache_buf *hnext;		/* next buffer in the hash chain */
+	char *data;
+};
+
+static size_t bcache_bytes = BCACHE_SIZE;
+static struct bcache_buf *bufs;
+static struct bcache_buf **htable;
+static char *bdata;
+static int nbufs;
+static int nbuckets;
+static int clock_hand;
+static int ndirty;
+static time_t oldest_dirty;
+static int nheld;
+static int nbusy;
+static unsigned long bcache_gen;
+static pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bcache_cond = PTHREAD_COND_INITIALIZER;	/* a commit finished its writes */
+
+/*
+ * Metadata journal: bio_write_meta() dirties a cached block like bio_write()
+ * but holds it, so it is not written in place until bio_commit() has logged
+ * it. The log follows a header block that holds the sequence number of its
+ * first transaction. A transaction is one or more descriptor blocks, each
+ * followed by the images it lists, and a commit block with a checksum of
+ * them all. A freed block with an image in the log is revoked, so replay
+ * does not write the old image over what the block holds now. Once the log
+ * is low on room, everything is written in place and the log starts over.
+ * The state is under bcache_lock, but a commit copies what it writes and
+ * does its I/O without it; commit_lock keeps commits one at a time. The
+ * blocks a commit writes in place are flagged in jflight until it is done,
+ * and nothing else writes, drops, or reads them from the disk meanwhile.
+ */
+#define JOURNAL_MAGIC	0x4A524E4C
+#define JDESC_MAGIC		0x4A445343
+#define JCOMMIT_MAGIC	0x4A434D54
+#define JDESC_MAX		(int)((BLOCK_SIZE - sizeof(struct jdesc))/sizeof(int32_t))
+
+struct jheader {
+	uint32_t magic;
+	uint32_t seq;							/* transaction the log starts with */
+};
+
+struct jdesc {
+	uint32_t magic;
+	uint32_t seq;							/* transaction the block belongs to */
+	uint32_t nblocks;						/* images following this block */
+	uint32_t nrevoke;
+	int32_t blocks[];						/* where each image goes, then the revoked blocks */
+};
+
+struct jcommit {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t csum;							/* of the descriptors and images of the transaction */
+};
+
+static int jstart;							/* journal header block */
+static int jblocks;							/* blocks of the journal, 0 when writes are not journaled */
+static int jhead;							/* next free log block */
+static uint32_t jseq;						/* sequence number of the next transaction */
+static unsigned char *jlogged;				/* bit per disk block that has an image in the log */
+static unsigned char *jflight;				/* bit per disk block the running commit writes in place */
+static unsigned char *jorder;				/* bit per data block mapped since the last commit */
+static int jwriting;						/* a commit is doing its I/O, held buffers may go after it */
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *jrevoke;						/* revoked blocks going out with the next transaction */
+static int nrevoke, caprevoke;
+
+static void journal_unrevoke(int block_num);	//journal, below
+
+/*
+ * Readahead: bio_readahead() queues blocks for a background thread, which
+ * reads the ones that are not cached yet without holding bcache_lock and adds
+ * them as clean buffers. A block written while its read is in flight is
+ * flagged in ra_stale (under bcache_lock) and dropped.
+ */
+static int ra_queue[BIO_RA_QUEUE];
+static int ra_head, ra_count, ra_stop, ra_running;
+static pthread_t ra_thread;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+static int ra_inflight[BIO_MAX_RUN];
+static int ra_stale[BIO_MAX_RUN];
+static int ra_ninflight;
+
+static int bcache_hash(int block_num) {
+	return (unsigned int)block_num % nbuckets;
+}
+
+static void bcache_init() {
+	if (bufs != NULL) {
+		return;
+	}
+	nbufs = bcache_bytes / BLOCK_SIZE;
+	if (nbufs < 8) nbufs = 8;
+	nbuckets = nbufs;
+	bufs = calloc(nbufs, sizeof(struct bcache_buf));
+	htable = calloc(nbuckets, sizeof(struct bcache_buf*));
+	if (bufs == NULL || htable == NULL || posix_memalign((void**)&bdata, BLOCK_SIZE, (size_t)nbufs * BLOCK_SIZE) != 0) {
+		perror("bcache_init failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < nbufs; i++) {
+		bufs[i].block_num = -1;
+		bufs[i].data = bdata + (size_t)i * BLOCK_SIZE;
+	}
+	clock_hand = 0;
+	ndirty = 0;
+	nheld = 0;
+	nbusy = 0;
+}
+
+static void bcache_free() {
+	free(bufs);
+	free(htable);
+	free(bdata);
+	bufs = NULL;
+	htable = NULL;
+	bdata = NULL;
+}
+
+static struct bcache_buf *bcache_lookup(int block_num) {
+	struct bcache_buf *b = htable[bcache_hash(block_num)];
+	while (b != NULL && b->block_num != block_num) b = b->hnext;
+	return b;
+}
+
+//Whether the running commit is writing block_num in place
+static int bcache_inflight(int block_num) {
+	return jflight != NULL && (jflight[block_num / 8] & (1 << (block_num & 7)));
+}
+
+static void bcache_unhash(struct bcache_buf *b) {
+	struct bcache_buf **p = &htable[bcache_hash(b->block_num)];
+	while (*p != b) p = &(*p)->hnext;
+	*p = b->hnext;
+	b->hnext = NULL;
+	b->block_num = -1;
+}
+
+static int bcache_writeback(struct bcache_buf *b) {
+	int retstat = pwrite(diskfile, b->data, BLOCK_SIZE, (off_t)b->block_num*BLOCK_SIZE);
+	if (retstat < 0) {
+		perror("block_write failed");
+		return retstat;
+	}
+	b->dirty = 0;
+	ndirty--;
+	return retstat;
+}
+
+//Pick a buffer for block_num with CLOCK, writing back the victim if needed. Held buffers are never
+//written in place before their commit, so with nothing else to evict it waits for a running
+//commit: -EAGAIN if block_num got cached or went in flight meanwhile, -ENOMEM with no commit running
+static int bcache_alloc(int block_num, struct bcache_buf **bp) {
+	struct bcache_buf *b;
+	for (int scanned = 0;; scanned++) {
+		//two passes clear every reference bit, so nothing left can go
+		if (scanned == 2*nbufs) {
+			if (!jwriting) return -ENOMEM;
+			pthread_cond_wait(&bcache_cond, &bcache_lock);
+			if (bcache_lookup(block_num) != NULL || bcache_inflight(block_num)) return -EAGAIN;
+			scanned = 0;
+		}
+		b = &bufs[clock_hand];
+		clock_hand = (clock_hand + 1) % nbufs;
+		if (b->block_num == -1) break;
+		//a block the commit writes an older copy of is written back after it
+		if (b->busy || b->held || (b->dirty && bcache_inflight(b->block_num))) continue;
+		if (b->ref) {
+			b->ref = 0;
+			continue;
+		}
+		if (b->dirty) bcache_writeback(b);
+		bcache_unhash(b);
+		break;
+	}
+	int h = bcache_hash(block_num);
+	b->block_num = block_num;
+	b->dirty = 0;
+	b->held = 0;
+	b->ref = 1;
+	b->gen = ++bcache_gen;
+	b->hnext = htable[h];
+	htable[h] = b;
+	*bp = b;
+	return 0;
+}
+
+static int bcache_cmp(const void *a, const void *b) {
+	return (*(struct bcache_buf**)a)->block_num - (*(struct bcache_buf**)b)->block_num;
+}
+
+//Write back every dirty buffer (or only those dirtied before 'before'), in block order; held ones
+//stay, and so do the ones the running commit writes an older copy of
+static int bcache_sync(time_t before) {
+	if (ndirty == 0) {
+		return 0;
+	}
+	struct bcache_buf **list = malloc(ndirty * sizeof(struct bcache_buf*));
+	int n = 0, retstat = 0;
+	time_t oldest = 0;
+	for (int i = 0; i < nbufs; i++) {
+		if (!bufs[i].dirty || bufs[i].held) continue;
+		if (bufs[i].dirtied < before && !bcache_inflight(bufs[i].block_num)) list[n++] = &bufs[i];
+		else if (oldest == 0 || bufs[i].dirtied < oldest) oldest = bufs[i].dirtied;
+	}
+	qsort(list, n, sizeof(struct bcache_buf*), bcache_cmp);
+	struct bio_req *reqs = malloc(n * sizeof(struct bio_req));
+	for (int i = 0; i < n; i++) {
+		reqs[i].block_num = list[i]->block_num;
+		reqs[i].buf = list[i]->data;
+		reqs[i].write = 1;
+	}
+	dev_rw(reqs, n);
+	for (int i = 0; i < n; i++) {
+		if (reqs[i].res < 0) {
+			retstat = -1;
+			continue;
+		}
+		list[i]->dirty = 0;
+		ndirty--;
+	}
+	oldest_dirty = oldest;
+	free(reqs);
+	free(list);
+	return retstat;
+}
+
+//Copy buf into the cached block and mark it dirty, hold keeps it for the journal. With every
+//buffer held or busy a plain write goes straight to the disk, and a held one fails with -ENOMEM
+static int bcache_put(int block_num, const void *buf, int hold) {
+	struct bcache_buf *b;
+	int retstat;
+	for (int i = 0; i < ra_ninflight; i++) {
+		if (ra_inflight[i] == block_num) ra_stale[i] = 1;
+	}
+	while ((b = bcache_lookup(block_num)) == NULL && (retstat = bcache_alloc(block_num, &b)) != 0) {
+		if (retstat == -EAGAIN) continue;
+		if (hold) return retstat;
+		char *tmp = bio_buf_get();
+		memcpy(tmp, buf, BLOCK_SIZE);
+		retstat = pwrite(diskfile, tmp, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+		if (retstat < 0)
+			perror("block_write failed");
+		bio_buf_put(tmp);
+		return retstat < 0 ? -EIO : 0;
+	}
+	if (b->busy) {
+		b->busy = 0;
+		nbusy--;
+	}
+	b->ref = 1;
+	b->gen = ++bcache_gen;
+	memcpy(b->data, buf, BLOCK_SIZE);
+	if (hold && !b->held) {
+		b->held = 1;
+		nheld++;
+		journal_unrevoke(block_num);
+	}
+	time_t now = time(NULL);
+	if (!b->dirty) {
+		b->dirty = 1;
+		b->dirtied = now;
+		ndirty++;
+		if (!b->held && (oldest_dirty == 0 || now < oldest_dirty)) oldest_dirty = now;
+	}
+	//Push out blocks that have been dirty for too long
+	if (oldest_dirty != 0 && now - oldest_dirty >= BCACHE_DIRTY_AGE) {
+		bcache_sync(now - BCACHE_DIRTY_AGE + 1);
+	}
+	return 0;
+}
+
+//Give a busy buffer what its read brought in, unless the block was written or dropped meanwhile
+static void bcache_fill(struct bcache_buf *b, int block_num, unsigned long gen, const void *buf, int res) {
+	if (b->block_num != block_num || !b->busy || b->gen != gen) {
+		return;
+	}
+	b->busy = 0;
+	nbusy--;
+	if (res <= 0) bcache_unhash(b);
+	else memcpy(b->data, buf, BLOCK_SIZE);
+}
+
+//FNV-1a over a block, chained through h
+static uint32_t journal_csum(uint32_t h, const void *data) {
+	const unsigned char *p = data;
+	for (int i = 0; i < BLOCK_SIZE; i++) {
+		h ^= p[i];
+		h *= 16777619;
+	}
+	return h;
+}
+
+static int journal_logged(int block_num) {
+	return jlogged != NULL && block_num >= 0 && block_num < DISK_SIZE/BLOCK_SIZE && (jlogged[block_num / 8] & (1 << (block_num & 7)));
+}
+
+//Revoke the log's image of a freed block with the next transaction
+static void journal_revoke(int block_num) {
+	if (!journal_logged(block_num)) {
+		return;
+	}
+	for (int i = 0; i < nrevoke; i++) {
+		if (jrevoke[i] == block_num) return;
+	}
+	if (nrevoke == caprevoke) {
+		caprevoke = caprevoke ? caprevoke * 2 : 64;
+		jrevoke = realloc(jrevoke, caprevoke * sizeof(int));
+	}
+	jrevoke[nrevoke++] = block_num;
+}
+
+//The block is metadata again, its new image goes out with the revoke's transaction
+static void journal_unrevoke(int block_num) {
+	for (int i = 0; i < nrevoke; i++) {
+		if (jrevoke[i] != block_num) continue;
+		jrevoke[i] = jrevoke[--nrevoke];
+		return;
+	}
+}
+
+//Write the header with an empty log, every logged image must be in place and synced
+static int journal_reset() {
+	struct jheader *h = bio_buf_get();
+	memset(h, 0, BLOCK_SIZE);
+	h->magic = JOURNAL_MAGIC;
+	h->seq = jseq;
+	struct bio_req r = { jstart, h, 1, 0 };
+	dev_rw(&r, 1);
+	int retstat = r.res < 0 || fdatasync(diskfile) < 0 ? -1 : 0;
+	bio_buf_put(h);
+	jhead = jstart + 1;
+	if (jlogged != NULL) memset(jlogged, 0, DISK_SIZE/BLOCK_SIZE/8);
+	nrevoke = 0;
+	return retstat;
+}
+
+//Write a batch and fdatasync() it, -EIO if any of it fails
+static int journal_write(struct bio_req *reqs, int n) {
+	int retstat = 0;
+	dev_rw(reqs, n);
+	for (int i = 0; i < n; i++) {
+		if (reqs[i].res < 0) retstat = -EIO;
+	}
+	if (fdatasync(diskfile) < 0) {
+		perror("disk_fdatasync failed");
+		retstat = -EIO;
+	}
+	return retstat;
+}
+
+//A buffer as journal_commit() copied it
+struct jsnap {
+	struct bcache_buf *b;
+	int block_num;
+	unsigned long gen;
+	void *data;								/* the copy that is written */
+};
+
+//Whether the buffer still holds what was copied
+static int jsnap_current(const struct jsnap *j) {
+	return bcache_lookup(j->block_num) == j->b && j->b->gen == j->gen;
+}
+
+/*
+ * Log the held buffers, and the pending revokes, as one transaction and
+ * write in place the dirty data blocks mapped since the last commit (see
+ * bio_order()). Those blocks, the descriptors and the images go out in one
+ * batch and are fdatasync()ed before the commit block is written and
+ * fdatasync()ed in turn, so a commit replay finds never covers blocks that
+ * did not make it; other dirty buffers are left to writeback. The logged buffers are left dirty, to be written in place
+ * like any other, and the log starts over once it is low on room. If any of
+ * it fails the transaction did not happen: its buffers stay held, the log
+ * head and sequence number stay where they were, and -EIO is returned.
+ * Called with commit_lock and bcache_lock held; the batch and the
+ * fdatasync() run without bcache_lock, from copies taken under it, and a
+ * buffer written again meanwhile stays held or dirty for the next commit.
+ */
+static int journal_commit() {
+	//Step 1: collect the held buffers and the dirty data blocks mapped since the last commit
+	struct jsnap *held = malloc((nheld + 1) * sizeof(struct jsnap));
+	struct jsnap *other = malloc((ndirty + 1) * sizeof(struct jsnap));
+	int nh = 0, no = 0, retstat = 0, reset = 0;
+	for (int i = 0; i < nbufs; i++) {
+		struct bcache_buf *b = &bufs[i];
+		if (b->held) held[nh++] = (struct jsnap){ b, b->block_num, b->gen, NULL };
+		else if (b->dirty && (jorder[b->block_num / 8] & (1 << (b->block_num & 7)))) {
+			other[no++] = (struct jsnap){ b, b->block_num, b->gen, NULL };
+		}
+	}
+	memset(jorder, 0, DISK_SIZE/BLOCK_SIZE/8);
+	int nr = nrevoke;
+	int nentries = nh + nr;
+	int ndesc = (nentries + JDESC_MAX - 1) / JDESC_MAX;
+	int len = nentries > 0 ? ndesc + nh + 1 : 0;
+	//Step 2: a transaction the log cannot take any more is written in place, unprotected
+	if (len > jstart + jblocks - jhead) {
+		for (int i = 0; i < nh; i++) {
+			held[i].b->held = 0;
+			other[no++] = held[i];
+		}
+		nheld -= nh;
+		nh = 0;
+		nentries = ndesc = len = 0;
+		reset = 1;
+	}
+	//Step 3: copy them; a revoke of a logged block must reach the log from now on, and the
+	//blocks going in place count as clean but stay in flight until the batch is done
+	jwriting = 1;
+	for (int i = 0; i < nh; i++) {
+		held[i].data = bio_buf_get();
+		memcpy(held[i].data, held[i].b->data, BLOCK_SIZE);
+		jlogged[held[i].block_num / 8] |= 1 << (held[i].block_num & 7);
+	}
+	for (int i = 0; i < no; i++) {
+		other[i].data = bio_buf_get();
+		memcpy(other[i].data, other[i].b->data, BLOCK_SIZE);
+		other[i].b->dirty = 0;
+		ndirty--;
+		jflight[other[i].block_num / 8] |= 1 << (other[i].block_num & 7);
+	}
+	int *revoked = malloc((nr + 1) * sizeof(int));
+	memcpy(revoked, jrevoke, nr * sizeof(int));
+	//Step 4: descriptors with their images, then the commit block, at the head of the log
+	struct bio_req *reqs = malloc((no + len + 1) * sizeof(struct bio_req));
+	struct bio_req commit = { -1, NULL, 1, 0 };
+	void **meta = malloc((ndesc + 1) * sizeof(void*));
+	int n = 0, pos = jhead, e = 0;
+	uint32_t csum = 2166136261u;
+	for (int d = 0; d < ndesc; d++) {
+		struct jdesc *desc = meta[d] = bio_buf_get();
+		memset(desc, 0, BLOCK_SIZE);
+		desc->magic = JDESC_MAGIC;
+		desc->seq = jseq;
+		int first = e;
+		for (int k = 0; k < JDESC_MAX && e < nentries; k++, e++) {
+			if (e < nh) {
+				desc->blocks[k] = held[e].block_num;
+				desc->nblocks++;
+			}
+			else {
+				desc->blocks[k] = revoked[e - nh];
+				desc->nrevoke++;
+			}
+		}
+		reqs[n++] = (struct bio_req){ pos++, desc, 1, 0 };
+		csum = journal_csum(csum, desc);
+		for (int i = first; i < first + (int)desc->nblocks; i++) {
+			reqs[n++] = (struct bio_req){ pos++, held[i].data, 1, 0 };
+			csum = journal_csum(csum, held[i].data);
+		}
+	}
+	if (len > 0) {
+		struct jcommit *c = meta[ndesc] = bio_buf_get();
+		memset(c, 0, BLOCK_SIZE);
+		c->magic = JCOMMIT_MAGIC;
+		c->seq = jseq;
+		c->csum = csum;
+		commit = (struct bio_req){ pos++, c, 1, 0 };
+	}
+	//Step 5: the data blocks in place and the log blocks before the commit block, each part
+	//made durable before the next, with the cache available to everyone else
+	for (int i = 0; i < no; i++) reqs[n++] = (struct bio_req){ other[i].block_num, other[i].data, 1, 0 };
+	pthread_mutex_unlock(&bcache_lock);
+	retstat = journal_write(reqs, n);
+	if (retstat == 0 && len > 0) retstat = journal_write(&commit, 1);
+	pthread_mutex_lock(&bcache_lock);
+	//Step 6: the blocks are out of flight, and on success the logged buffers not written since
+	//may go in place from now on; whoever waits for a buffer may look again
+	time_t now = time(NULL);
+	for (int i = 0; i < no; i++) jflight[other[i].block_num / 8] &= ~(1 << (other[i].block_num & 7));
+	if (retstat == 0) {
+		for (int i = 0; i < nh; i++) {
+			if (!jsnap_current(&held[i]) || !held[i].b->held) continue;
+			held[i].b->held = 0;
+			held[i].b->dirtied = now;
+			nheld--;
+		}
+		for (int i = 0; i < nr; i++) journal_unrevoke(revoked[i]);
+		if (len > 0) {
+			jhead += len;
+			jseq++;
+		}
+	}
+	jwriting = 0;
+	pthread_cond_broadcast(&bcache_cond);
+	//Step 7: on failure the blocks going in place are dirty again unless they were written
+	//meanwhile, and the logged ones stay held: the next transaction, a superset of this one,
+	//is written over the same log blocks
+	for (int i = 0; i < no && retstat < 0; i++) {
+		struct bcache_buf *b = other[i].b;
+		if (jsnap_current(&other[i]) && !b->dirty) {
+			b->dirty = 1;
+			b->dirtied = now;
+			ndirty++;
+		}
+		else if (bcache_lookup(other[i].block_num) == NULL) {
+			bcache_put(other[i].block_num, other[i].data, 0);
+		}
+	}
+	oldest_dirty = ndirty > 0 ? now : 0;
+	//Step 8: start the log over once it is low on room, after what it holds is in place and
+	//durable; a logged buffer written again since is still held, so its logged copy goes in place
+	if (retstat == 0 && (reset || jstart + jblocks - jhead < BIO_JOURNAL_RESERVE)) {
+		int nlate = 0;
+		for (int i = 0; i < nh; i++) {
+			if (bcache_lookup(held[i].block_num) != held[i].b || !held[i].b->held) continue;
+			reqs[nlate++] = (struct bio_req){ held[i].block_num, held[i].data, 1, 0 };
+		}
+		dev_rw(reqs, nlate);
+		for (int i = 0; i < nlate; i++) {
+			if (reqs[i].res < 0) retstat = -EIO;
+		}
+		if (retstat == 0 && bcache_sync(now + 1) < 0) retstat = -EIO;
+		if (retstat == 0 && fdatasync(diskfile) < 0) {
+			perror("disk_fdatasync failed");
+			retstat = -EIO;
+		}
+		if (retstat == 0 && journal_reset() < 0) retstat = -EIO;
+	}
+	for (int i = 0; i < nh; i++) bio_buf_put(held[i].data);
+	for (int i = 0; i < no; i++) bio_buf_put(other[i].data);
+	for (int d = 0; d < ndesc + (len > 0); d++) bio_buf_put(meta[d]);
+	free(revoked);
+	free(meta);
+	free(reqs);
+	free(other);
+	free(held);
+	return retstat;
+}
+
+/*
+ * Replay the log: write in place the images of every committed transaction,
+ * in order, except images revoked by the same or a later transaction
+ */
+static int journal_replay(int nblocks) {
+	//Step 1: read the whole journal with one batch
+	char *log;
+	struct bio_req *reqs = malloc(nblocks * sizeof(struct bio_req));
+	if (posix_memalign((void**)&log, BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE) != 0) {
+		perror("journal_replay failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < nblocks; i++) reqs[i] = (struct bio_req){ jstart + i, log + (size_t)i * BLOCK_SIZE, 0, 0 };
+	dev_rw(reqs, nblocks);
+	free(reqs);
+	struct jheader *h = (struct jheader*)log;
+	if (h->magic != JOURNAL_MAGIC) {
+		free(log);
+		return -1;
+	}
+	//Step 2: find the committed transactions, they follow each other with the next sequence number
+	//and a commit block whose checksum matches
+	int *txstart = malloc(nblocks * sizeof(int));
+	int ntx = 0, pos = 1;
+	while (pos < nblocks) {
+		int p = pos, ok = 0;
+		uint32_t csum = 2166136261u;
+		while (p < nblocks) {
+			struct jdesc *d = (struct jdesc*)(log + (size_t)p * BLOCK_SIZE);
+			if (d->magic == JDESC_MAGIC && d->seq == h->seq + ntx && d->nblocks + d->nrevoke <= (uint32_t)JDESC_MAX
+					&& p + 1 + (int)d->nblocks < nblocks) {
+				for (int j = 0; j <= (int)d->nblocks; j++) csum = journal_csum(csum, log + (size_t)(p + j) * BLOCK_SIZE);
+				p += 1 + d->nblocks;
+				continue;
+			}
+			struct jcommit *c = (struct jcommit*)d;
+			ok = p > pos && c->magic == JCOMMIT_MAGIC && c->seq == h->seq + ntx && c->csum == csum;
+			break;
+		}
+		if (!ok) break;
+		txstart[ntx++] = pos;
+		pos = p + 1;
+	}
+	//Step 3: the last transaction that revoked each block, then the images it does not cover
+	uint32_t *revoked = calloc(DISK_SIZE/BLOCK_SIZE, sizeof(uint32_t));
+	for (int pass = 0; pass < 2; pass++) {
+		for (int t = 0; t < ntx; t++) {
+			for (int p = txstart[t]; p < (t + 1 < ntx ? txstart[t + 1] : pos) - 1; ) {
+				struct jdesc *d = (struct jdesc*)(log + (size_t)p * BLOCK_SIZE);
+				for (int j = 0; j < (int)(d->nblocks + d->nrevoke); j++) {
+					int b = d->blocks[j];
+					if (b < 0 || b >= DISK_SIZE/BLOCK_SIZE || (b >= jstart && b < jstart + nblocks)) continue;
+					if (pass == 0 && j >= (int)d->nblocks) revoked[b] = t + 1;
+					if (pass == 1 && j < (int)d->nblocks && revoked[b] <= (uint32_t)t) {
+						char *img = log + (size_t)(p + 1 + j) * BLOCK_SIZE;
+						if (dmap != NULL) memcpy(bio_map(b), img, BLOCK_SIZE);
+						else bcache_put(b, img, 0);
+					}
+				}
+				p += 1 + d->nblocks;
+			}
+		}
+	}
+	//Step 4: make it stick before the log is emptied
+	int retstat = 0;
+	if (ntx > 0) {
+		if (dmap != NULL) retstat = msync(dmap, DISK_SIZE, MS_SYNC);
+		else if (bcache_sync(time(NULL) + 1) < 0 || fdatasync(diskfile) < 0) retstat = -1;
+	}
+	jseq = h->seq + ntx;
+	free(revoked);
+	free(txstart);
+	free(log);
+	return retstat;
+}
+
+//Read the blocks that are not cached yet and add them to the cache
+static void ra_fill(const int *blocks, int n) {
+	struct bio_req reqs[BIO_MAX_RUN];
+	int nreq = 0;
+	//Step 1: pick the missing blocks and start watching them for writes
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < n; i++) {
+		if (bcache_lookup(blocks[i]) != NULL || bcache_inflight(blocks[i])) continue;
+		reqs[nreq] = (struct bio_req){ blocks[i], bio_buf_get(), 0, 0 };
+		ra_inflight[nreq] = blocks[i];
+		ra_stale[nreq] = 0;
+		nreq++;
+	}
+	ra_ninflight = nreq;
+	pthread_mutex_unlock(&bcache_lock);
+	//Step 2: read them while the cache stays available to everyone else
+	dev_rw(reqs, nreq);
+	//Step 3: cache the blocks nobody wrote or read in meanwhile
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < nreq; i++) {
+		if (reqs[i].res == BLOCK_SIZE && !ra_stale[i] && bcache_lookup(reqs[i].block_num) == NULL) {
+			struct bcache_buf *b;
+			if (bcache_alloc(reqs[i].block_num, &b) == 0) memcpy(b->data, reqs[i].buf, BLOCK_SIZE);
+		}
+		bio_buf_put(reqs[i].buf);
+	}
+	ra_ninflight = 0;
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+static void *ra_worker(void *arg) {
+	int blocks[BIO_MAX_RUN];
+	pthread_mutex_lock(&ra_lock);
+	for (;;) {
+		while (!ra_stop && ra_count == 0) pthread_cond_wait(&ra_cond, &ra_lock);
+		if (ra_stop) break;
+		int n = 0;
+		while (ra_count > 0 && n < BIO_MAX_RUN) {
+			blocks[n++] = ra_queue[ra_head];
+			ra_head = (ra_head + 1) % BIO_RA_QUEUE;
+			ra_count--;
+		}
+		pthread_mutex_unlock(&ra_lock);
+		ra_fill(blocks, n);
+		pthread_mutex_lock(&ra_lock);
+	}
+	pthread_mutex_unlock(&ra_lock);
+	return NULL;
+}
+
+static void ra_init() {
+	ra_stop = 0;
+	ra_head = ra_count = 0;
+	ra_running = pthread_create(&ra_thread, NULL, ra_worker, NULL) == 0;
+}
+
+static void ra_free() {
+	if (!ra_running) {
+		return;
+	}
+	pthread_mutex_lock(&ra_lock);
+	ra_stop = 1;
+	pthread_cond_signal(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+	pthread_join(ra_thread, NULL);
+	ra_running = 0;
+}
+
+//Map the disk file, falls back to pread/pwrite if it cannot be mapped
+static void dev_map() {
+	dmap = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+	if (dmap == MAP_FAILED) {
+		perror("disk_mmap failed");
+		dmap = NULL;
+		devmode = DEV_PREAD;
+	}
+}
+
+//Open the disk file, with O_DIRECT in DEV_DIRECT mode if the file system allows it
+static int dev_openfile(const char *diskfile_path, int flags) {
+	if (devmode == DEV_DIRECT) {
+		int fd = open(diskfile_path, flags | O_DIRECT, S_IRUSR | S_IWUSR);
+		if (fd >= 0 || errno != EINVAL) {
+			return fd;
+		}
+		perror("disk_open O_DIRECT failed");
+		devmode = DEV_PREAD;
+	}
+	return open(diskfile_path, flags, S_IRUSR | S_IWUSR);
+}
+
+//Set up the backend selected with dev_mode() on the open disk file
+static void dev_setup() {
+	if (devmode == DEV_MMAP) dev_map();
+	if (dmap == NULL) {
+		bcache_init();
+		queue_init();
+		//file data is read through the block cache only in DEV_DIRECT mode, see bio_fd()
+		if (devmode == DEV_DIRECT) ra_init();
+	}
+}
 
 //Creates a file which is your new emulated disk
 void dev_init(const char* diskfile_path) {
     if (diskfile >= 0) {
 		return;
     }
-    
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+
+    diskfile = dev_openfile(diskfile_path, O_CREAT | O_RDWR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		exit(EXIT_FAILURE);
     }
-	
+
     ftruncate(diskfile, DISK_SIZE);
+	dev_setup();
 }
 
 //Function to open the disk file
@@ -42,41 +1094,519 @@ int dev_open(const char* diskfile_path) {
     if (diskfile >= 0) {
 		return 0;
     }
-    
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
+
+    diskfile = dev_openfile(diskfile_path, O_RDWR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		return -1;
     }
+	dev_setup();
 	return 0;
 }
 
 void dev_close() {
     if (diskfile >= 0) {
+		bio_commit();
+		bio_flush();
+		//everything is in place now, leave an empty log behind
+		pthread_mutex_lock(&bcache_lock);
+		if (jblocks > 0 && fdatasync(diskfile) == 0) journal_reset();
+		jblocks = 0;
+		free(jlogged);
+		free(jflight);
+		free(jorder);
+		free(jrevoke);
+		jlogged = NULL;
+		jflight = NULL;
+		jorder = NULL;
+		jrevoke = NULL;
+		nrevoke = caprevoke = 0;
+		pthread_mutex_unlock(&bcache_lock);
+		if (dmap != NULL) {
+			munmap(dmap, DISK_SIZE);
+			dmap = NULL;
+		}
+		else {
+			ra_free();
+			queue_free();
+		}
+		bcache_free();
+		pthread_mutex_lock(&buf_lock);
+		while (buf_nfree > 0) free(buf_pool[--buf_nfree]);
+		pthread_mutex_unlock(&buf_lock);
 		close(diskfile);
+		diskfile = -1;
     }
 }
 
+//Set the memory budget of the block cache, must be called before the disk is opened
+void bio_cache_size(size_t bytes) {
+	bcache_bytes = bytes;
+}
+
+//Select the device backend (DEV_PREAD, DEV_MMAP or DEV_DIRECT), must be called before the disk is opened
+void dev_mode(int mode) {
+	devmode = mode;
+}
+
+//Get a BLOCK_SIZE buffer that O_DIRECT can transfer to and from
+void *bio_buf_get() {
+	void *buf = NULL;
+	pthread_mutex_lock(&buf_lock);
+	if (buf_nfree > 0) buf = buf_pool[--buf_nfree];
+	pthread_mutex_unlock(&buf_lock);
+	if (buf == NULL && posix_memalign(&buf, BLOCK_SIZE, BLOCK_SIZE) != 0) {
+		perror("bio_buf_get failed");
+		exit(EXIT_FAILURE);
+	}
+	return buf;
+}
+
+//Give back a buffer from bio_buf_get()
+void bio_buf_put(void *buf) {
+	pthread_mutex_lock(&buf_lock);
+	if (buf_nfree < BIO_BUF_POOL) {
+		buf_pool[buf_nfree++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&buf_lock);
+	free(buf);
+}
+
+//Pointer to a block of the mapped disk, NULL unless the device is in DEV_MMAP mode
+void *bio_map(const int block_num) {
+	if (dmap == NULL || block_num < 0 || block_num >= DISK_SIZE/BLOCK_SIZE) {
+		return NULL;
+	}
+	return dmap + (size_t)block_num*BLOCK_SIZE;
+}
+
+//Write all dirty cached blocks to the disk
+int bio_flush() {
+	if (dmap != NULL) {
+		int retstat = msync(dmap, DISK_SIZE, MS_SYNC);
+		if (retstat < 0)
+			perror("disk_msync failed");
+		return retstat;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	int retstat = bcache_sync(time(NULL) + 1);
+	pthread_mutex_unlock(&bcache_lock);
+	return retstat;
+}
+
+//Write back the dirty blocks that have waited at least age seconds, every one of them for 0
+int bio_writeback(int age) {
+	if (dmap != NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	int retstat = bcache_sync(time(NULL) - age + 1);
+	pthread_mutex_unlock(&bcache_lock);
+	return retstat;
+}
+
+//Percent of the block cache holding dirty blocks, 0 in DEV_MMAP mode where the kernel writes pages back
+int bio_dirty_ratio() {
+	if (dmap != NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	int ratio = nbufs > 0 ? ndirty * 100 / nbufs : 0;
+	pthread_mutex_unlock(&bcache_lock);
+	return ratio;
+}
+
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
-    int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat <= 0) {
-		memset (buf, 0, BLOCK_SIZE);
-		if (retstat < 0)
-			perror("block_read failed");
-    }
+    int retstat = BLOCK_SIZE;
+	if (dmap != NULL) {
+		char *mapped = bio_map(block_num);
+		if (mapped == NULL) {
+			memset(buf, 0, BLOCK_SIZE);
+			return 0;
+		}
+		memcpy(buf, mapped, BLOCK_SIZE);
+		return retstat;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	struct bcache_buf *b;
+	for (;;) {
+		//the disk has the block once the commit writing it is done
+		while ((b = bcache_lookup(block_num)) == NULL && bcache_inflight(block_num)) {
+			pthread_cond_wait(&bcache_cond, &bcache_lock);
+		}
+		if (b != NULL && !b->busy) {
+			b->ref = 1;
+			memcpy(buf, b->data, BLOCK_SIZE);
+			pthread_mutex_unlock(&bcache_lock);
+			return retstat;
+		}
+		//a miss gets a busy buffer to fill in after the read, one another read has in flight is read again,
+		//and so is one that finds every buffer taken
+		if (b != NULL || nbusy >= nbufs / 2) {
+			b = NULL;
+			break;
+		}
+		int err = bcache_alloc(block_num, &b);
+		if (err == 0) {
+			b->busy = 1;
+			nbusy++;
+			break;
+		}
+		if (err == -ENOMEM) {
+			b = NULL;
+			break;
+		}
+	}
+	unsigned long gen = b != NULL ? b->gen : 0;
+	pthread_mutex_unlock(&bcache_lock);
+
+	char *tmp = bio_buf_get();
+	retstat = pread(diskfile, tmp, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+	if (retstat < 0)
+		perror("block_read failed");
+	if (retstat < BLOCK_SIZE)
+		memset(tmp + (retstat > 0 ? retstat : 0), 0, BLOCK_SIZE - (retstat > 0 ? retstat : 0));
+	if (b != NULL) {
+		pthread_mutex_lock(&bcache_lock);
+		bcache_fill(b, block_num, gen, tmp, retstat);
+		pthread_mutex_unlock(&bcache_lock);
+	}
+	memcpy(buf, tmp, BLOCK_SIZE);
+	bio_buf_put(tmp);
 
     return retstat;
 }
 
+//Descriptor of the disk file, for moving file data with it directly; -1 in DEV_MMAP and DEV_DIRECT mode
+int bio_fd() {
+	return dmap == NULL && devmode != DEV_DIRECT ? diskfile : -1;
+}
+
+//Write back the dirty cached copies of blocks, so reading them through bio_fd() sees the latest data
+int bio_clean(const int *block_nums, int n) {
+	if (dmap != NULL || n <= 0) {
+		return 0;
+	}
+	struct bio_req *reqs = malloc(n * sizeof(struct bio_req));
+	struct bcache_buf **dirty = malloc(n * sizeof(struct bcache_buf*));
+	int nreq = 0, retstat = 0;
+	pthread_mutex_lock(&bcache_lock);
+	//blocks the running commit writes are on the disk once it is done
+	for (int i = 0; i < n; i++) {
+		if (!bcache_inflight(block_nums[i])) continue;
+		pthread_cond_wait(&bcache_cond, &bcache_lock);
+		i = -1;
+	}
+	for (int i = 0; i < n; i++) {
+		struct bcache_buf *b = bcache_lookup(block_nums[i]);
+		if (b == NULL || !b->dirty || b->held) continue;
+		reqs[nreq] = (struct bio_req){ b->block_num, b->data, 1, 0 };
+		dirty[nreq++] = b;
+	}
+	dev_rw(reqs, nreq);
+	for (int i = 0; i < nreq; i++) {
+		if (reqs[i].res < 0) {
+			retstat = -1;
+			continue;
+		}
+		dirty[i]->dirty = 0;
+		ndirty--;
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	free(dirty);
+	free(reqs);
+	return retstat;
+}
+
+//Make the given blocks durable without flushing the rest of the cache: their dirty copies go out
+//as one batch, then DISKFILE is fdatasync()ed; in DEV_MMAP mode each run of them is msync()ed
+int bio_sync(const int *block_nums, int n) {
+	int retstat = 0;
+	if (dmap != NULL) {
+		for (int i = 0, j; i < n; i = j) {
+			for (j = i + 1; j < n && block_nums[j] == block_nums[j-1] + 1; j++);
+			if (msync(dmap + (size_t)block_nums[i]*BLOCK_SIZE, (size_t)(j - i)*BLOCK_SIZE, MS_SYNC) < 0) {
+				perror("disk_msync failed");
+				retstat = -1;
+			}
+		}
+		return retstat;
+	}
+	retstat = bio_clean(block_nums, n);
+	if (fdatasync(diskfile) < 0) {
+		perror("disk_fdatasync failed");
+		retstat = -1;
+	}
+	return retstat;
+}
+
+//Forget the cached copies of blocks that were freed or written through bio_fd(), dirty or not
+void bio_drop(const int *block_nums, int n) {
+	if (dmap != NULL) {
+		return;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < n; i++) {
+		//the commit's copy must land before whatever the block holds next
+		while (bcache_inflight(block_nums[i])) pthread_cond_wait(&bcache_cond, &bcache_lock);
+		struct bcache_buf *b = bcache_lookup(block_nums[i]);
+		if (b != NULL) {
+			if (b->dirty) ndirty--;
+			if (b->held) nheld--;
+			if (b->busy) nbusy--;
+			b->dirty = 0;
+			b->held = 0;
+			b->busy = 0;
+			bcache_unhash(b);
+		}
+		//an old image in the log must not be replayed over what the block holds next
+		journal_revoke(block_nums[i]);
+		for (int j = 0; j < ra_ninflight; j++) {
+			if (ra_inflight[j] == block_nums[i]) ra_stale[j] = 1;
+		}
+	}
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+//Zero blocks [block_num, block_num+n) on the disk without going through the cache: the range is
+//zeroed in DISKFILE by fallocate() where its filesystem can, otherwise written from one zero buffer
+//with pwritev() in batches. Cached copies are dropped first.
+int bio_zero(int block_num, int n) {
+	if (n <= 0) {
+		return 0;
+	}
+	if (dmap != NULL) {
+		memset(dmap + (size_t)block_num*BLOCK_SIZE, 0, (size_t)n*BLOCK_SIZE);
+		return 0;
+	}
+	int *blknos = malloc(n * sizeof(int));
+	for (int i = 0; i < n; i++) blknos[i] = block_num + i;
+	bio_drop(blknos, n);
+	free(blknos);
+	off_t off = (off_t)block_num*BLOCK_SIZE, len = (off_t)n*BLOCK_SIZE;
+	if (fallocate(diskfile, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off, len) == 0 ||
+			fallocate(diskfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0) {
+		return 0;
+	}
+	//aligned, so this works in DEV_DIRECT mode too
+	void *zero = bio_buf_get();
+	memset(zero, 0, BLOCK_SIZE);
+	struct iovec iov[BIO_MAX_RUN];
+	for (int i = 0; i < BIO_MAX_RUN; i++) iov[i] = (struct iovec){ zero, BLOCK_SIZE };
+	int retstat = 0;
+	while (len > 0 && retstat == 0) {
+		int cnt = len / BLOCK_SIZE < BIO_MAX_RUN ? len / BLOCK_SIZE : BIO_MAX_RUN;
+		ssize_t res = pwritev(diskfile, iov, cnt, off);
+		if (res <= 0 || res % BLOCK_SIZE != 0) {
+			perror("bio_zero failed");
+			retstat = -1;
+			break;
+		}
+		off += res;
+		len -= res;
+	}
+	bio_buf_put(zero);
+	return retstat;
+}
+
+//Use blocks [start_blk, start_blk+nblocks) as the metadata journal: create sets up an empty one,
+//otherwise the committed transactions left in it are replayed. -1 if there is no journal there.
+int bio_journal(int start_blk, int nblocks, int create) {
+	if (nblocks < 3 || start_blk <= 0 || start_blk + nblocks > DISK_SIZE/BLOCK_SIZE) {
+		return -1;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	jstart = start_blk;
+	jseq = 1;
+	int retstat = create ? 0 : journal_replay(nblocks);
+	if (retstat == 0) retstat = journal_reset();
+	//mapped pages go to the disk whenever the kernel likes, so in DEV_MMAP mode nothing is held back
+	jblocks = retstat == 0 && dmap == NULL ? nblocks : 0;
+	if (jblocks > 0 && jlogged == NULL) jlogged = calloc(DISK_SIZE/BLOCK_SIZE/8, 1);
+	if (jblocks > 0 && jflight == NULL) jflight = calloc(DISK_SIZE/BLOCK_SIZE/8, 1);
+	if (jblocks > 0 && jorder == NULL) jorder = calloc(DISK_SIZE/BLOCK_SIZE/8, 1);
+	pthread_mutex_unlock(&bcache_lock);
+	return retstat;
+}
+
+//Write a metadata block: held in the cache until bio_commit() logs it, a plain bio_write() without a journal;
+//-ENOMEM if every cache buffer is held already
+int bio_write_meta(const int block_num, const void *buf) {
+	if (dmap != NULL || jblocks == 0) {
+		return bio_write(block_num, buf);
+	}
+	pthread_mutex_lock(&bcache_lock);
+	int retstat = bcache_put(block_num, buf, 1);
+	pthread_mutex_unlock(&bcache_lock);
+	return retstat < 0 ? retstat : BLOCK_SIZE;
+}
+
+//Make every write so far durable, the held metadata as one logged transaction; the caller
+//makes sure no metadata update is half done
+int bio_commit() {
+	if (dmap != NULL) {
+		return bio_flush();
+	}
+	pthread_mutex_lock(&commit_lock);
+	pthread_mutex_lock(&bcache_lock);
+	int journaled = jblocks > 0;
+	int retstat = journaled ? journal_commit() : bcache_sync(time(NULL) + 1);
+	pthread_mutex_unlock(&bcache_lock);
+	if (!journaled && fdatasync(diskfile) < 0) retstat = -1;
+	pthread_mutex_unlock(&commit_lock);
+	return retstat;
+}
+
+//Blocks [block_num, block_num+n) were just mapped as file data: the next commit writes their dirty
+//cached copies in place with the metadata that maps them, so that never points at stale blocks
+void bio_order(int block_num, int n) {
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = block_num; i < block_num + n && jorder != NULL; i++) jorder[i / 8] |= 1 << (i & 7);
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+//Metadata blocks waiting for bio_commit()
+int bio_held() {
+	pthread_mutex_lock(&bcache_lock);
+	int n = nheld;
+	pthread_mutex_unlock(&bcache_lock);
+	return n;
+}
+
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
-    int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0) {
-		    perror("block_write failed");
-    }
-    return retstat;
+	if (dmap != NULL) {
+		char *mapped = bio_map(block_num);
+		if (mapped == NULL) {
+			return -1;
+		}
+		memcpy(mapped, buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	int retstat = bcache_put(block_num, buf, 0);
+	pthread_mutex_unlock(&bcache_lock);
+    return retstat < 0 ? -1 : BLOCK_SIZE;
+}
+
+//Read and write a list of blocks, the reads that miss the cache go to the disk together
+int bio_submit(struct bio_req *reqs, int nreqs) {
+	int retstat = 0;
+	if (dmap != NULL) {
+		for (int i = 0; i < nreqs; i++) {
+			if (reqs[i].write) reqs[i].res = bio_write(reqs[i].block_num, reqs[i].buf);
+			else reqs[i].res = bio_read(reqs[i].block_num, reqs[i].buf);
+			if (reqs[i].res < 0) retstat = -1;
+		}
+		return retstat;
+	}
+	struct bio_req **miss = malloc(nreqs * sizeof(struct bio_req*));
+	struct bio_req *io = malloc(nreqs * sizeof(struct bio_req));
+	struct bcache_buf **slot = malloc(nreqs * sizeof(struct bcache_buf*));
+	unsigned long *gen = malloc(nreqs * sizeof(unsigned long));
+	int nmiss = 0;
+	pthread_mutex_lock(&bcache_lock);
+	//Step 1: writes go to the cache and reads are served from it where possible, in order
+	for (int i = 0; i < nreqs; i++) {
+		struct bio_req *r = &reqs[i];
+		struct bcache_buf *b;
+		if (r->write) {
+			r->res = bcache_put(r->block_num, r->buf, 0) < 0 ? -1 : BLOCK_SIZE;
+			if (r->res < 0) retstat = -1;
+			continue;
+		}
+		while ((b = bcache_lookup(r->block_num)) == NULL && bcache_inflight(r->block_num)) {
+			pthread_cond_wait(&bcache_cond, &bcache_lock);
+		}
+		if (b != NULL && !b->busy) {
+			b->ref = 1;
+			memcpy(r->buf, b->data, BLOCK_SIZE);
+			r->res = BLOCK_SIZE;
+			continue;
+		}
+		//a miss gets a busy buffer to fill in later, one another read has in flight is read again,
+		//and so is one that finds every buffer taken
+		int err = b == NULL && nbusy < nbufs / 2 ? bcache_alloc(r->block_num, &b) : -ENOMEM;
+		if (err == -EAGAIN) {
+			i--;
+			continue;
+		}
+		if (err == 0) {
+			b->busy = 1;
+			nbusy++;
+		}
+		else {
+			b = NULL;
+		}
+		miss[nmiss] = r;
+		io[nmiss] = *r;
+		slot[nmiss] = b;
+		gen[nmiss] = b != NULL ? b->gen : 0;
+		nmiss++;
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	//Step 2: read every miss with one batch, without the lock
+	dev_rw(io, nmiss);
+	//Step 3: cache the blocks not written or dropped meanwhile
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < nmiss; i++) {
+		miss[i]->res = io[i].res;
+		if (io[i].res < 0) retstat = -1;
+		if (slot[i] != NULL) bcache_fill(slot[i], io[i].block_num, gen[i], io[i].buf, io[i].res);
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	free(gen);
+	free(slot);
+	free(io);
+	free(miss);
+	return retstat;
+}
+
+//Start reading blocks into the cache in the background, blocks that do not fit in the queue are skipped
+void bio_readahead(const int *block_nums, int n) {
+	if (dmap != NULL) {
+		for (int i = 0; i < n; i++) {
+			char *mapped = bio_map(block_nums[i]);
+			if (mapped != NULL) madvise(mapped, BLOCK_SIZE, MADV_WILLNEED);
+		}
+		return;
+	}
+	if (!ra_running) {
+		//blocks read with bio_fd() come from the page cache of the disk file
+		for (int i = 0; i < n; i++) {
+			posix_fadvise(diskfile, (off_t)block_nums[i]*BLOCK_SIZE, BLOCK_SIZE, POSIX_FADV_WILLNEED);
+		}
+		return;
+	}
+	pthread_mutex_lock(&ra_lock);
+	for (int i = 0; i < n && ra_count < BIO_RA_QUEUE; i++) {
+		ra_queue[(ra_head + ra_count) % BIO_RA_QUEUE] = block_nums[i];
+		ra_count++;
+	}
+	pthread_cond_signal(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
 }
 
+//Read n blocks into bufs, the ones missing from the cache are read in runs of consecutive blocks
+int bio_readv(const int *block_nums, void **bufs, int n) {
+	struct bio_req *reqs = malloc(n * sizeof(struct bio_req));
+	for (int i = 0; i < n; i++) {
+		reqs[i] = (struct bio_req){ block_nums[i], bufs[i], 0, 0 };
+	}
+	int retstat = bio_submit(reqs, n);
+	free(reqs);
+	return retstat < 0 ? retstat : n*BLOCK_SIZE;
+}
+
+//Write n blocks from bufs, writeback merges them with their neighbours on the disk
+int bio_writev(const int *block_nums, void **bufs, int n) {
+	struct bio_req *reqs = malloc(n * sizeof(struct bio_req));
+	for (int i = 0; i < n; i++) {
+		reqs[i] = (struct bio_req){ block_nums[i], bufs[i], 1, 0 };
+	}
+	int retstat = bio_submit(reqs, n);
+	free(reqs);
+	return retstat < 0 ? retstat : n*BLOCK_SIZE;
+}
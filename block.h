@@ -5,16 +5,67 @@
  *
  */
 
+#include <stddef.h>
+
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
 #define BLOCK_SIZE 4096
 #define DISK_SIZE	32*1024*1024
 
+#define BCACHE_SIZE			(4*1024*1024)	/* default memory budget of the block cache */
+#define BCACHE_DIRTY_AGE	5				/* seconds a dirty block may sit in the cache */
+#define BIO_QUEUE_DEPTH		64				/* requests bio_submit() keeps in flight */
+#define BIO_THREADS			4				/* pread workers when io_uring is not available */
+#define BIO_MAX_RUN			64				/* consecutive blocks merged into one preadv/pwritev */
+#define BIO_RA_QUEUE		512				/* blocks waiting for the readahead thread */
+
+/* device backends, see dev_mode() */
+#define DEV_PREAD	0						/* pread/pwrite through the block cache */
+#define DEV_MMAP	1						/* DISKFILE mapped into memory, no block cache */
+#define DEV_DIRECT	2						/* O_DIRECT, blocks are cached only by the block cache */
+
+#define BIO_BUF_POOL		64				/* free aligned buffers kept by bio_buf_put() */
+#define BIO_JOURNAL_RESERVE	96				/* free log blocks below which bio_commit() starts the log over */
+
+/* one block read or write of a batch, see bio_submit() */
+struct bio_req {
+	int block_num;
+	void *buf;
+	int write;								/* 0 reads the block into buf, 1 writes buf to it */
+	int res;								/* what bio_read()/bio_write() would have returned */
+};
+
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
 void dev_close();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_submit(struct bio_req *reqs, int nreqs);
+int bio_readv(const int *block_nums, void **bufs, int n);
+int bio_writev(const int *block_nums, void **bufs, int n);
+void bio_readahead(const int *block_nums, int n);
+
+void bio_cache_size(size_t bytes);
+int bio_flush();
+int bio_writeback(int age);
+int bio_dirty_ratio();
+
+int bio_journal(int start_blk, int nblocks, int create);
+int bio_write_meta(const int block_num, const void *buf);
+int bio_commit();
+int bio_held();
+void bio_order(int block_num, int n);
+
+void dev_mode(int mode);
+void *bio_map(const int block_num);
+int bio_fd();
+int bio_clean(const int *block_nums, int n);
+int bio_sync(const int *block_nums, int n);
+void bio_drop(const int *block_nums, int n);
+int bio_zero(int block_num, int n);
+
+void *bio_buf_get();
+void bio_buf_put(void *buf);
 
 #endif
@@ -9,7 +9,7 @@
 #define DIR 1
 #define FIL 2
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -18,9 +18,13 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 #include <libgen.h>
 #include <limits.h>
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/falloc.h>
 
 #include "block.h"
 #include "tfs.h"
@@ -34,331 +38,2017 @@ int num_inode_blocks = ((MAX_INUM*sizeof(struct inode))+BLOCK_SIZE-1)/BLOCK_SIZE
 int num_data_blocks = (MAX_DNUM+BLOCK_SIZE-1)/BLOCK_SIZE;
 int num_inodebmap_blocks = (((MAX_INUM*sizeof(unsigned char))/8)+BLOCK_SIZE-1)/BLOCK_SIZE;
 int num_dblockbmap_blocks = (((MAX_DNUM*sizeof(unsigned char))/8)+BLOCK_SIZE-1)/BLOCK_SIZE;
-int num_dirent_per_block = (BLOCK_SIZE)/sizeof(struct dirent);
+int num_dirent_per_block = BLOCK_SIZE/DIRENT_REC_LEN(1);
 bitmap_t inodebmap;
 bitmap_t dblockbmap;
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Locking: each inode has a reader/writer lock (ilock) that covers its data and
+ * inode fields. Namespace operations lock the parent directory before the child.
+ * Under those, the shared in-memory tables have their own mutexes, always taken
+ * in this order: ptr_cache_lock, alloc_lock, then icache_lock or dcache_lock.
+ */
+static pthread_rwlock_t ilocks[MAX_INUM];
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ptr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ilock(uint16_t ino, int excl) {
+	if(excl) pthread_rwlock_wrlock(&ilocks[ino]);
+	else pthread_rwlock_rdlock(&ilocks[ino]);
+}
+
+static void iunlock(uint16_t ino) {
+	pthread_rwlock_unlock(&ilocks[ino]);
+}
+
+/* 
+ * Read-only view of a block: the mapped block itself in DEV_MMAP mode,
+ * otherwise a copy read into buf
+ */
+static void *bread(int blkno, void *buf) {
+	void *mapped = bio_map(blkno);
+	if(mapped != NULL) return mapped;
+	bio_read(blkno, buf);
+	return buf;
+}
+
+static int ino_hint = 0;
+static int blkno_hint = 0;
+static int free_blocks = 0;			// free data blocks, under alloc_lock
+static int reserved_blocks = 0;		// of them, promised to delayed allocation
+
+// bmap() alloc value: fill a hole from blocks the caller reserved with reserve_blocks()
+#define BMAP_RESERVED 2
+static long nlookup[MAX_INUM];	// lookups the kernel holds on each inode, under alloc_lock
+static uint8_t map_changed[MAX_INUM];	// size or block map changed since the last commit, under the inode lock
+
+/*
+ * Write back only the bitmap block holding bit i
+ */
+static void bitmap_sync(bitmap_t map, int start_blk, int i) {
+	int blk = i / (BLOCK_SIZE*8);
+	bio_write_meta(start_blk + blk, map + (blk*BLOCK_SIZE));
+}
+
+/* 
+ * Read or write both bitmaps whole; they sit next to each other on disk so
+ * this is a single vectored I/O
+ */
+static void bitmap_io(int write) {
+	int n = num_inodebmap_blocks + num_dblockbmap_blocks;
+	int blknos[n];
+	void *bufs[n];
+	for(int i = 0; i < num_inodebmap_blocks; i++){
+		blknos[i] = sblock->i_bitmap_blk + i;
+		bufs[i] = inodebmap + (i*BLOCK_SIZE);
+	}
+	for(int i = 0; i < num_dblockbmap_blocks; i++){
+		blknos[num_inodebmap_blocks + i] = sblock->d_bitmap_blk + i;
+		bufs[num_inodebmap_blocks + i] = dblockbmap + (i*BLOCK_SIZE);
+	}
+	if(write) bio_writev(blknos, bufs, n);
+	else bio_readv(blknos, bufs, n);
+}
+
+static int ipinned(uint16_t ino);	// inode cache, below
 
 /* 
  * Get available inode number from bitmap
  */
 int get_avail_ino() {
-	// Step 1: Read inode bitmap from disk
-	for(int i = sblock->i_bitmap_blk; i < (sblock->i_bitmap_blk+num_inodebmap_blocks); i++){
-		bio_read(i, (inodebmap+((i-sblock->i_bitmap_blk)*BLOCK_SIZE)));
-	}
-	// Step 2: Traverse inode bitmap to find an available slot
-	int index = 0;
-	while(get_bitmap(inodebmap, index) == 1 && index < MAX_INUM) index++;
-	if(index == MAX_INUM) return -1; //nothing found
-	// Step 3: Update inode bitmap and write to disk 
-	set_bitmap(inodebmap, index);
-	for(int i = sblock->i_bitmap_blk; i < (sblock->i_bitmap_blk+num_inodebmap_blocks); i++){
-		bio_write(i, (inodebmap+((i-sblock->i_bitmap_blk)*BLOCK_SIZE)));
+	// Step 1: The inode bitmap stays resident after tfs_init
+	// Step 2: Traverse inode bitmap to find an available slot, starting at the next-fit hint
+	// skipping removed inodes that an open file still pins or the kernel still knows by number
+	pthread_mutex_lock(&alloc_lock);
+	int index = find_zero_bitmap(inodebmap, MAX_INUM, ino_hint);
+	for(int tries = 0; index != -1 && (nlookup[index] > 0 || ipinned(index)); tries++){
+		index = tries < MAX_INUM ? find_zero_bitmap(inodebmap, MAX_INUM, index + 1) : -1;
+	}
+	if(index == -1){
+		pthread_mutex_unlock(&alloc_lock);
+		return -1; //nothing found
 	}
-	return (sblock->i_start_blk+index);
+	// Step 3: Update inode bitmap and mark its block dirty
+	set_bitmap(inodebmap, index);
+	bitmap_sync(inodebmap, sblock->i_bitmap_blk, index);
+	ino_hint = index + 1;
+	pthread_mutex_unlock(&alloc_lock);
+	return index;
 }
 
 /* 
- * Get available data block number from bitmap
+ * Count n more kernel lookups of ino, or drop n of them when n is negative
+ */
+static void lookup_ref(uint16_t ino, long n) {
+	pthread_mutex_lock(&alloc_lock);
+	nlookup[ino] += n;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Preallocation windows: runs of free data blocks set aside in memory (the
+ * bitmap is not touched) for a file that is being appended sequentially, so
+ * its next blocks come out contiguous. Windows are in data bitmap indexes.
  */
-int get_avail_blkno() {
-	
-	// Step 1: Read data block bitmap from disk
-	for(int i = sblock->d_bitmap_blk; i < (sblock->d_bitmap_blk+num_dblockbmap_blocks); i++){
-		bio_read(i, (dblockbmap+((i-sblock->d_bitmap_blk)*BLOCK_SIZE)));
+struct prealloc {
+	int ino;						/* owner of the window */
+	int next;						/* next block to hand out */
+	int end;						/* one past the last reserved block, empty if next == end */
+};
+static struct prealloc prealloc_tab[PREALLOC_SLOTS];
+static int prealloc_slot = 0;
+
+static struct prealloc *prealloc_find(int ino) {
+	for(int i = 0; i < PREALLOC_SLOTS; i++){
+		if(prealloc_tab[i].ino == ino && prealloc_tab[i].next < prealloc_tab[i].end) return &prealloc_tab[i];
+	}
+	return NULL;
+}
+
+// End of the window that reserves index, 0 if it is not reserved
+static int prealloc_reserved(int index) {
+	for(int i = 0; i < PREALLOC_SLOTS; i++){
+		if(index >= prealloc_tab[i].next && index < prealloc_tab[i].end) return prealloc_tab[i].end;
+	}
+	return 0;
+}
+
+void prealloc_discard(int ino) {
+	struct prealloc *p;
+	pthread_mutex_lock(&alloc_lock);
+	while((p = prealloc_find(ino)) != NULL) p->next = p->end;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+static int data_block_count() {
+	int ndata = totalblocks - sblock->d_start_blk;
+	return ndata > MAX_DNUM ? MAX_DNUM : ndata;
+}
+
+// Find a free data block index at or after start that nobody has reserved
+static int find_free_index(int start) {
+	int ndata = data_block_count();
+	for(int tries = 0; tries <= PREALLOC_SLOTS; tries++){
+		int index = find_zero_bitmap(dblockbmap, ndata, start);
+		if(index == -1) return -1;
+		int end = prealloc_reserved(index);
+		if(end == 0) return index;
+		start = end;
 	}
-	
-	// Step 2: Traverse data block bitmap to find an available slot
-	int index = 0;
-	while(get_bitmap(dblockbmap, index) == 1 && index < MAX_DNUM) index++;
-	if(index == MAX_DNUM) return -1; //nothing found
+	// every free block left is reserved, give the windows back
+	for(int i = 0; i < PREALLOC_SLOTS; i++) prealloc_tab[i].next = prealloc_tab[i].end;
+	return find_zero_bitmap(dblockbmap, ndata, start);
+}
 
-	// Step 3: Update data block bitmap and write to disk 
+static void claim_index(int index) {
 	set_bitmap(dblockbmap, index);
-	for(int i = sblock->d_bitmap_blk; i < (sblock->d_bitmap_blk+num_dblockbmap_blocks); i++){
-		bio_write(i, (dblockbmap+((i-sblock->d_bitmap_blk)*BLOCK_SIZE)));
+	free_blocks--;
+	bitmap_sync(dblockbmap, sblock->d_bitmap_blk, index);
+	bio_order(sblock->d_start_blk + index, 1);
+	blkno_hint = index + 1;
+}
+
+// Whether a block may be claimed: blocks promised to delayed allocation are only
+// handed out to the reservations that hold them
+static int can_claim(int reserved) {
+	return reserved || free_blocks - reserved_blocks > 0;
+}
+
+/* 
+ * Get available data block number from bitmap, reserved says the caller
+ * takes it out of its own reservation
+ */
+int get_avail_blkno(int reserved) {
+	// Step 1: The data block bitmap stays resident after tfs_init
+	// Step 2: Traverse data block bitmap to find an available slot, starting at the next-fit hint
+	pthread_mutex_lock(&alloc_lock);
+	int index = can_claim(reserved) ? find_free_index(blkno_hint) : -1;
+	if(index == -1){
+		pthread_mutex_unlock(&alloc_lock);
+		return -1; //nothing found
 	}
+
+	// Step 3: Update data block bitmap and mark its block dirty
+	claim_index(index);
+	pthread_mutex_unlock(&alloc_lock);
 	return (sblock->d_start_blk+index);
 }
 
+/* 
+ * Get a data block for a file, as close after goal as possible. The rest of
+ * the free run found there becomes the file's preallocation window.
+ */
+int get_avail_run(int ino, int goal, int reserved) {
+	int gindex = goal - sblock->d_start_blk;
+	pthread_mutex_lock(&alloc_lock);
+	if(!can_claim(reserved)){
+		pthread_mutex_unlock(&alloc_lock);
+		return -1;
+	}
+	// Step 1: Hand out the next block of the file's window if it continues at goal
+	struct prealloc *p = prealloc_find(ino);
+	if(p != NULL && p->next == gindex){
+		claim_index(p->next++);
+		pthread_mutex_unlock(&alloc_lock);
+		return goal;
+	}
+	if(p != NULL) p->next = p->end;
+	// Step 2: Find the first free block at or after goal
+	int ndata = data_block_count();
+	int index = find_free_index(gindex > 0 && gindex < ndata ? gindex : blkno_hint);
+	if(index == -1){
+		pthread_mutex_unlock(&alloc_lock);
+		return -1;
+	}
+	claim_index(index);
+	// Step 3: Reserve the free blocks that follow it
+	int end = index + 1;
+	while(end < ndata && end - index < PREALLOC_BLOCKS && get_bitmap(dblockbmap, end) == 0 && prealloc_reserved(end) == 0) end++;
+	if(end > index + 1){
+		p = &prealloc_tab[prealloc_slot];
+		prealloc_slot = (prealloc_slot + 1) % PREALLOC_SLOTS;
+		p->ino = ino;
+		p->next = index + 1;
+		p->end = end;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return (sblock->d_start_blk+index);
+}
+
+/* 
+ * Claim a run of up to len free data blocks for fallocate: the first run at or
+ * after goal that is long enough, else the longest one. Returns its first
+ * block and sets *got to its length, -1 if no block is free.
+ */
+int get_avail_range(int goal, int len, int *got) {
+	int gindex = goal - sblock->d_start_blk;
+	int ndata = data_block_count();
+	pthread_mutex_lock(&alloc_lock);
+	// Step 1: Walk the free runs from goal to the end of the disk, then from the start
+	int start = gindex > 0 && gindex < ndata ? gindex : blkno_hint % ndata;
+	int best = -1, best_len = 0;
+	for(int pass = 0; pass < 2 && best_len < len; pass++){
+		int i = pass == 0 ? start : 0;
+		int stop = pass == 0 ? ndata : start;
+		while(i < stop && best_len < len){
+			int index = find_zero_bitmap(dblockbmap, ndata, i);
+			if(index < i || index >= stop) break;
+			int end = prealloc_reserved(index);
+			if(end != 0){
+				i = end;
+				continue;
+			}
+			end = index + 1;
+			while(end < ndata && end - index < len && get_bitmap(dblockbmap, end) == 0 && prealloc_reserved(end) == 0) end++;
+			if(end - index > best_len){
+				best = index;
+				best_len = end - index;
+			}
+			i = end;
+		}
+	}
+	// Step 2: Blocks promised to delayed allocation are not ours to take
+	if(best_len > free_blocks - reserved_blocks) best_len = free_blocks - reserved_blocks;
+	if(best == -1 || best_len <= 0){
+		pthread_mutex_unlock(&alloc_lock);
+		return -1;
+	}
+	// Step 3: Claim the run with one write per bitmap block
+	for(int i = best; i < best + best_len; i++) set_bitmap(dblockbmap, i);
+	free_blocks -= best_len;
+	for(int b = best / (BLOCK_SIZE*8); b <= (best + best_len - 1) / (BLOCK_SIZE*8); b++){
+		bitmap_sync(dblockbmap, sblock->d_bitmap_blk, b * BLOCK_SIZE*8);
+	}
+	bio_order(sblock->d_start_blk + best, best_len);
+	blkno_hint = best + best_len;
+	pthread_mutex_unlock(&alloc_lock);
+	*got = best_len;
+	return (sblock->d_start_blk+best);
+}
+
+/* 
+ * Return an inode number to the inode bitmap
+ */
+void free_ino(int ino) {
+	pthread_mutex_lock(&alloc_lock);
+	unset_bitmap(inodebmap, ino);
+	bitmap_sync(inodebmap, sblock->i_bitmap_blk, ino);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/* 
+ * Return a data block number to the data block bitmap
+ */
+void free_blkno(int blkno) {
+	int index = blkno - sblock->d_start_blk;
+	pthread_mutex_lock(&alloc_lock);
+	unset_bitmap(dblockbmap, index);
+	bitmap_sync(dblockbmap, sblock->d_bitmap_blk, index);
+	free_blocks++;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Data blocks a truncation gives up, freed together by free_list_commit()
+ */
+struct free_list {
+	int n;
+	int cap;
+	int *blknos;
+};
+
+static void free_list_add(struct free_list *fl, int start, int len) {
+	if(fl->n + len > fl->cap){
+		fl->cap = (fl->n + len) * 2;
+		fl->blknos = realloc(fl->blknos, fl->cap * sizeof(int));
+	}
+	for(int i = 0; i < len; i++) fl->blknos[fl->n++] = start + i;
+}
+
+/* 
+ * Return every block of fl to the data block bitmap in one update, writing
+ * each bitmap block it touched once
+ */
+static void free_list_commit(struct free_list *fl) {
+	// their cached copies are dead, drop them before the blocks can be handed out again
+	bio_drop(fl->blknos, fl->n);
+	char touched[num_dblockbmap_blocks];
+	memset(touched, 0, sizeof(touched));
+	pthread_mutex_lock(&alloc_lock);
+	for(int i = 0; i < fl->n; i++){
+		int index = fl->blknos[i] - sblock->d_start_blk;
+		unset_bitmap(dblockbmap, index);
+		touched[index / (BLOCK_SIZE*8)] = 1;
+	}
+	free_blocks += fl->n;
+	for(int b = 0; b < num_dblockbmap_blocks; b++){
+		if(touched[b]) bitmap_sync(dblockbmap, sblock->d_bitmap_blk, b * BLOCK_SIZE*8);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	free(fl->blknos);
+	fl->n = fl->cap = 0;
+	fl->blknos = NULL;
+}
+
+/* 
+ * Count the free data blocks once the data block bitmap is loaded
+ */
+static void count_free_blocks() {
+	int ndata = data_block_count();
+	free_blocks = 0;
+	for(int i = 0; i < ndata; i++){
+		if(get_bitmap(dblockbmap, i) == 0) free_blocks++;
+	}
+}
+
+/* 
+ * Promise n free blocks to delayed allocation, 0 if fewer are left
+ */
+static int reserve_blocks(int n) {
+	pthread_mutex_lock(&alloc_lock);
+	int ok = free_blocks - reserved_blocks >= n;
+	if(ok) reserved_blocks += n;
+	pthread_mutex_unlock(&alloc_lock);
+	return ok;
+}
+
+/* 
+ * Blocks a delayed block of inode reserves: itself, and the most pointer or
+ * extent leaf blocks mapping it can take. A pointer-mapped block may need an
+ * indirect block and a double indirect one, an extent insert at most one new leaf.
+ */
+static int reserve_units(struct inode *inode) {
+	return 1 + (inode->flags & EXTENT_FL ? 1 : 2);
+}
+
+static void unreserve_blocks(int n) {
+	pthread_mutex_lock(&alloc_lock);
+	reserved_blocks -= n;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
 /* 
  * inode operations
  */
-int readi(uint16_t ino, struct inode *inode) {
 
-  // Step 1: Get the inode's on-disk block number
-  int block_no = sblock->i_start_blk;
+/*
+ * Inode cache: inodes hashed by ino with reference counts. readi() and
+ * writei() work on the cached copy; dirty inodes are written back by isync(),
+ * one read-modify-write per inode table block, or when they are evicted.
+ */
+struct icache_ent {
+	struct inode inode;				/* must stay first, iput() casts back from it */
+	int used;						/* entry holds an inode */
+	int refcnt;						/* active iget() references, pinned while > 0 */
+	int dirty;						/* cached inode differs from the inode table */
+	int ref;						/* CLOCK reference bit */
+	int dir_hint;					/* directory block that last had a free slot */
+	struct icache_ent *hnext;		/* next entry in the hash chain */
+};
+static struct icache_ent icache[ICACHE_SIZE];
+static struct icache_ent *ihash[ICACHE_SIZE];
+static int icache_hand = 0;
 
-  //block_no will be right after this calculation
-  int inodes_per_block = MAX_INUM/num_inode_blocks;
-  int i = ino;
-  while((i/inodes_per_block) > 0){
-	  i-=inodes_per_block;
-	  block_no++;
-  }
-  
-  //block_no will be accurate now
-
-  // Step 2: Get offset of the inode in the inode on-disk block
-  int offset = i;
-  // Step 3: Read the block from disk and then copy into inode structure
-  struct inode buf[(BLOCK_SIZE/sizeof(struct inode))+1];
-  bio_read(block_no, &buf);
-  inode->ino = buf[offset].ino;
-  inode->valid = buf[offset].valid;
-  inode->size = buf[offset].size;
-  inode->type = buf[offset].type;
-  for(int i = 0; i < 16; i++){
-	  inode->direct_ptr[i] = buf[offset].direct_ptr[i];
-  }
-  for(int i = 0; i < 8; i++){
-	  inode->indirect_ptr[i] = buf[offset].indirect_ptr[i];
+// Inode table block holding ino, and its slot in that block
+static int inode_block(uint16_t ino, int *offset) {
+	int inodes_per_block = MAX_INUM/num_inode_blocks;
+	*offset = ino % inodes_per_block;
+	return sblock->i_start_blk + ino / inodes_per_block;
+}
+
+// Write every dirty cached inode living in inode table block blk with one read-modify-write
+static void isync_block(int blk) {
+	struct inode buf[(BLOCK_SIZE/sizeof(struct inode))+1];
+	int offset;
+	bio_read(blk, &buf);
+	for(int i = 0; i < ICACHE_SIZE; i++){
+		if(!icache[i].used || !icache[i].dirty) continue;
+		if(inode_block(icache[i].inode.ino, &offset) != blk) continue;
+		buf[offset] = icache[i].inode;
+		icache[i].dirty = 0;
+	}
+	bio_write_meta(blk, &buf);
+}
+
+/* 
+ * Write back all dirty inodes
+ */
+void isync() {
+	int offset;
+	pthread_mutex_lock(&icache_lock);
+	for(int i = 0; i < ICACHE_SIZE; i++){
+		if(icache[i].used && icache[i].dirty) isync_block(inode_block(icache[i].inode.ino, &offset));
+	}
+	pthread_mutex_unlock(&icache_lock);
+}
+
+static void icache_unhash(struct icache_ent *e) {
+	struct icache_ent **p = &ihash[e->inode.ino % ICACHE_SIZE];
+	while(*p != e) p = &(*p)->hnext;
+	*p = e->hnext;
+	e->used = 0;
+}
+
+/* 
+ * Drop every cached inode, dirty ones must have been written back
+ */
+void icache_reset() {
+	memset(icache, 0, sizeof(icache));
+	memset(ihash, 0, sizeof(ihash));
+	icache_hand = 0;
+}
+
+// iget() with icache_lock held
+static struct inode *iget_locked(uint16_t ino) {
+	// Step 1: Look ino up in the hash table
+	struct icache_ent *e = ihash[ino % ICACHE_SIZE];
+	while(e != NULL && e->inode.ino != ino) e = e->hnext;
+	if(e != NULL){
+		e->refcnt++;
+		e->ref = 1;
+		return &e->inode;
+	}
+	// Step 2: Pick an unpinned entry with CLOCK, writing it back if needed
+	int scanned;
+	for(scanned = 0; scanned < 2*ICACHE_SIZE; scanned++){
+		e = &icache[icache_hand];
+		icache_hand = (icache_hand + 1) % ICACHE_SIZE;
+		if(!e->used) break;
+		if(e->refcnt > 0) continue;
+		if(e->ref){
+			e->ref = 0;
+			continue;
+		}
+		int offset;
+		if(e->dirty) isync_block(inode_block(e->inode.ino, &offset));
+		icache_unhash(e);
+		break;
+	}
+	if(scanned == 2*ICACHE_SIZE) return NULL;
+	// Step 3: Read the inode from its inode table block
+	struct inode buf[(BLOCK_SIZE/sizeof(struct inode))+1];
+	int offset;
+	struct inode *itable = bread(inode_block(ino, &offset), &buf);
+	e->inode = itable[offset];
+	e->inode.ino = ino;
+	e->used = 1;
+	e->refcnt = 1;
+	e->dirty = 0;
+	e->ref = 1;
+	e->hnext = ihash[ino % ICACHE_SIZE];
+	ihash[ino % ICACHE_SIZE] = e;
+	return &e->inode;
+}
+
+/* 
+ * Get a pinned in-memory inode, reading it from disk if it is not cached
+ */
+struct inode *iget(uint16_t ino) {
+	pthread_mutex_lock(&icache_lock);
+	struct inode *inode = iget_locked(ino);
+	pthread_mutex_unlock(&icache_lock);
+	return inode;
+}
+
+/* 
+ * Whether ino is cached and pinned by an iget() reference
+ */
+static int ipinned(uint16_t ino) {
+	pthread_mutex_lock(&icache_lock);
+	struct icache_ent *e = ihash[ino % ICACHE_SIZE];
+	while(e != NULL && e->inode.ino != ino) e = e->hnext;
+	int pinned = e != NULL && e->refcnt > 0;
+	pthread_mutex_unlock(&icache_lock);
+	return pinned;
+}
+
+/* 
+ * Release a reference taken by iget()
+ */
+void iput(struct inode *inode) {
+	pthread_mutex_lock(&icache_lock);
+	((struct icache_ent *)inode)->refcnt--;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+int readi(uint16_t ino, struct inode *inode) {
+
+  // Step 1: Get the inode from the inode cache, it is read from disk on a miss
+  pthread_mutex_lock(&icache_lock);
+  struct inode *cached = iget_locked(ino);
+  if(cached == NULL){
+	  // every cached inode is pinned, go to the inode table directly
+	  struct inode buf[(BLOCK_SIZE/sizeof(struct inode))+1];
+	  int offset;
+	  struct inode *itable = bread(inode_block(ino, &offset), &buf);
+	  *inode = itable[offset];
+	  pthread_mutex_unlock(&icache_lock);
+	  return 0;
   }
-  inode->vstat.st_uid = buf[offset].vstat.st_uid;
-  inode->vstat.st_gid = buf[offset].vstat.st_gid;
-  inode->vstat.st_mode = buf[offset].vstat.st_mode;
-  inode->vstat.st_nlink = buf[offset].vstat.st_nlink;
-  inode->vstat.st_size = buf[offset].vstat.st_size;
-  inode->vstat.st_blksize = buf[offset].vstat.st_blksize;
-  //IF INODE DOES NOT EXIST IT WILL CAUSE SEGFAULT
+  // Step 2: Copy into inode structure
+  *inode = *cached;
+  ((struct icache_ent *)cached)->refcnt--;
+  pthread_mutex_unlock(&icache_lock);
   return 0;
 }
 
 int writei(uint16_t ino, struct inode *inode) {
 
-	// Step 1: Get the block number where this inode resides on disk
-	int block_no = sblock->i_start_blk;
+	// Step 1: Get the cached copy of the inode
+	pthread_mutex_lock(&icache_lock);
+	struct inode *cached = iget_locked(ino);
+	if(cached == NULL){
+		// every cached inode is pinned, update the inode table directly
+		struct inode buf[(BLOCK_SIZE/sizeof(struct inode))+1];
+		int offset;
+		int blk = inode_block(ino, &offset);
+		bio_read(blk, &buf);
+		buf[offset] = *inode;
+		bio_write_meta(blk, &buf);
+		pthread_mutex_unlock(&icache_lock);
+		map_changed[ino] = 1;
+		return 0;
+	}
+	// Step 2: Update it and leave the inode table write to isync()
+	struct icache_ent *e = (struct icache_ent *)cached;
+	if(cached->size != inode->size) map_changed[ino] = 1;
+	*cached = *inode;
+	e->dirty = 1;
+	e->refcnt--;
+	pthread_mutex_unlock(&icache_lock);
+	return 0;
+}
 
-	//block_no will be right after this calculation
-	int inodes_per_block = MAX_INUM/num_inode_blocks;
-	int i = ino;
-	while((i/inodes_per_block) > 0){
-		i-=inodes_per_block;
-		block_no++;
+/* 
+ * Stamp the inode's ctime with the current time, and its mtime too when the
+ * contents changed. The caller writes the inode back.
+ */
+void itouch(struct inode *inode, int modified) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	inode->vstat.st_ctim = now;
+	if(modified) inode->vstat.st_mtim = now;
+}
+
+
+/* 
+ * block mapping
+ */
+
+// Recently used indirect blocks, so walking a large file does not re-read its pointer blocks
+#define PTR_CACHE_SLOTS 4
+struct ptr_cache_ent {
+	int blkno;
+	int ptrs[PTRS_PER_BLOCK];
+};
+static struct ptr_cache_ent ptr_cache[PTR_CACHE_SLOTS];
+static int ptr_cache_next = 0;
+
+static int *ptr_block(int blkno, int fresh) {
+	struct ptr_cache_ent *e = NULL;
+	for(int i = 0; i < PTR_CACHE_SLOTS; i++){
+		if(ptr_cache[i].blkno == blkno) e = &ptr_cache[i];
 	}
-	//block_no will be accurate now
-	struct inode buf[(BLOCK_SIZE/sizeof(struct inode))+1];
-	memset(&buf, 0, sizeof(struct inode)*((BLOCK_SIZE/sizeof(struct inode))+1));
-	bio_read(block_no, &buf);
-	// Step 2: Get the offset in the block where this inode resides on disk
-	int offset = i;
-	buf[offset].ino = inode->ino;
-	buf[offset].valid = inode->valid;
-	buf[offset].size = inode->size;
-	buf[offset].type = inode->type;
-	for(int i = 0; i < 16; i++){
-		buf[offset].direct_ptr[i] = inode->direct_ptr[i];
-	}
-	for(int i = 0; i < 8; i++){
-		buf[offset].indirect_ptr[i] = inode->indirect_ptr[i];
-	}
-	buf[offset].vstat.st_uid = inode->vstat.st_uid;
-	buf[offset].vstat.st_gid = inode->vstat.st_gid;
-	buf[offset].vstat.st_mode = inode->vstat.st_mode ;
-	buf[offset].vstat.st_nlink = inode->vstat.st_nlink;
-	buf[offset].vstat.st_size = inode->vstat.st_size;
-	buf[offset].vstat.st_blksize = inode->vstat.st_blksize;
-	// Step 3: Write inode to disk 
-	bio_write(block_no, &buf);
+	if(e == NULL){
+		e = &ptr_cache[ptr_cache_next];
+		ptr_cache_next = (ptr_cache_next + 1) % PTR_CACHE_SLOTS;
+		e->blkno = blkno;
+		if(!fresh) bio_read(blkno, e->ptrs);
+	}
+	if(fresh){
+		memset(e->ptrs, 0, BLOCK_SIZE);
+		bio_write_meta(blkno, e->ptrs);
+	}
+	return e->ptrs;
+}
+
+static void ptr_block_drop(int blkno) {
+	for(int i = 0; i < PTR_CACHE_SLOTS; i++){
+		if(ptr_cache[i].blkno == blkno) ptr_cache[i].blkno = 0;
+	}
+}
+
+// Follow (or fill in) an indirect pointer held in the inode itself
+static int bmap_top(int *slot, int alloc) {
+	if(*slot == 0 && alloc){
+		int blkno = get_avail_blkno(alloc == BMAP_RESERVED);
+		if(blkno == -1) return -1;
+		*slot = blkno;
+		ptr_block(blkno, 1);
+	}
+	return *slot;
+}
+
+// Follow (or fill in) entry idx of pointer block pblk
+static int bmap_ind(int pblk, int idx, int alloc, int is_ptr) {
+	int *ptrs = ptr_block(pblk, 0);
+	int blkno = ptrs[idx];
+	if(blkno == 0 && alloc){
+		blkno = get_avail_blkno(alloc == BMAP_RESERVED);
+		if(blkno == -1) return -1;
+		ptrs[idx] = blkno;
+		bio_write_meta(pblk, ptrs);
+		if(is_ptr) ptr_block(blkno, 1);
+	}
+	return blkno;
+}
+
+/*
+ * extent mapping
+ *
+ * An EXTENT_FL inode keeps up to NUM_EXTENTS extents sorted by lblk in the
+ * inode. When they run out the extents move to a leaf block and the inode
+ * extents become index entries (EXTENT_IDX_FL), one per leaf.
+ */
+static int ext_count(struct extent *e, int cap) {
+	int n = 0;
+	while(n < cap && e[n].len > 0) n++;
+	return n;
+}
+
+// Index of the last extent starting at or before lblk, -1 if none
+static int ext_lookup(struct extent *e, int n, int lblk) {
+	int lo = 0, hi = n - 1, k = -1;
+	while(lo <= hi){
+		int mid = (lo + hi) / 2;
+		if(e[mid].lblk <= (uint32_t)lblk){
+			k = mid;
+			lo = mid + 1;
+		}
+		else hi = mid - 1;
+	}
+	return k;
+}
+
+// Insert extent x at position pos of the inode's extents (leaf < 0) or of leaf 'leaf',
+// a new leaf block comes out of the caller's reservation if reserved is set
+static int ext_insert(struct inode *inode, int leaf, int pos, struct extent x, int reserved) {
+	struct extent *e = inode->extents;
+	int n = ext_count(e, NUM_EXTENTS);
+	if(leaf < 0){
+		if(n < NUM_EXTENTS){
+			memmove(&e[pos+1], &e[pos], (n-pos)*sizeof(struct extent));
+			e[pos] = x;
+			return 0;
+		}
+		// Out of room in the inode, move the extents to a leaf block
+		int blkno = get_avail_blkno(reserved);
+		if(blkno == -1) return -1;
+		struct extent *l = (struct extent *)ptr_block(blkno, 1);
+		memcpy(l, e, n*sizeof(struct extent));
+		bio_write_meta(blkno, l);
+		memset(e, 0, NUM_EXTENTS*sizeof(struct extent));
+		e[0].lblk = 0;
+		e[0].len = n;
+		e[0].start = blkno;
+		inode->flags |= EXTENT_IDX_FL;
+		leaf = 0;
+	}
+	struct extent l[EXTENTS_PER_BLOCK+1];
+	memset(l, 0, sizeof(l));
+	n = e[leaf].len;
+	memcpy(l, ptr_block(e[leaf].start, 0), n*sizeof(struct extent));
+	memmove(&l[pos+1], &l[pos], (n-pos)*sizeof(struct extent));
+	l[pos] = x;
+	n++;
+	ptr_block_drop(e[leaf].start);
+	if(n <= EXTENTS_PER_BLOCK){
+		e[leaf].len = n;
+		bio_write_meta(e[leaf].start, l);
+		return 0;
+	}
+	// The leaf is full, split it. Appends put only the new extent in the new leaf.
+	int ni = ext_count(e, NUM_EXTENTS);
+	if(ni == NUM_EXTENTS) return -1;
+	int blkno = get_avail_blkno(reserved);
+	if(blkno == -1) return -1;
+	int half = pos == n - 1 ? n - 1 : n / 2;
+	struct extent r[EXTENTS_PER_BLOCK+1];
+	memset(r, 0, sizeof(r));
+	memcpy(r, &l[half], (n-half)*sizeof(struct extent));
+	memset(&l[half], 0, (n-half)*sizeof(struct extent));
+	bio_write_meta(e[leaf].start, l);
+	ptr_block_drop(blkno);
+	bio_write_meta(blkno, r);
+	memmove(&e[leaf+2], &e[leaf+1], (ni-leaf-1)*sizeof(struct extent));
+	e[leaf].len = half;
+	e[leaf+1].lblk = r[0].lblk;
+	e[leaf+1].len = n - half;
+	e[leaf+1].start = blkno;
 	return 0;
 }
 
+// Extent array that covers lblk: the inode's own (leaf -1) or the leaf block of index entry leaf
+static struct extent *ext_leaf(struct inode *inode, int lblk, int *leaf, int *n) {
+	struct extent *e = inode->extents;
+	*n = ext_count(e, NUM_EXTENTS);
+	*leaf = -1;
+	if(inode->flags & EXTENT_IDX_FL){
+		*leaf = ext_lookup(e, *n, lblk);
+		if(*leaf < 0) *leaf = 0;
+		*n = e[*leaf].len;
+		e = (struct extent *)ptr_block(e[*leaf].start, 0);
+	}
+	return e;
+}
+
+static int ext_bmap(struct inode *inode, int lblk, int alloc) {
+	// Step 1: Find the extent array that covers lblk
+	int leaf, n;
+	struct extent *e = ext_leaf(inode, lblk, &leaf, &n);
+	// Step 2: Return the data block if an extent maps lblk
+	int k = ext_lookup(e, n, lblk);
+	if(k >= 0 && lblk < e[k].lblk + e[k].len) return e[k].start + (lblk - e[k].lblk);
+	if(!alloc) return 0;
+	// Step 3: Allocate a block, aiming right after the previous extent
+	int goal = k >= 0 ? e[k].start + (lblk - e[k].lblk) : 0;
+	int blkno = get_avail_run(inode->ino, goal, alloc == BMAP_RESERVED);
+	if(blkno == -1) return -1;
+	// Step 4: Grow the previous extent if the block continues it, otherwise add an extent
+	if(k >= 0 && e[k].lblk + e[k].len == lblk && e[k].start + e[k].len == blkno){
+		e[k].len++;
+		if(leaf >= 0) bio_write_meta(inode->extents[leaf].start, e);
+		return blkno;
+	}
+	struct extent x = { lblk, 1, blkno };
+	if(ext_insert(inode, leaf, k+1, x, alloc == BMAP_RESERVED) == -1){
+		free_blkno(blkno);
+		return -1;
+	}
+	return blkno;
+}
 
 /* 
- * directory operations
+ * Map the hole [lblk, lblk+len) of inode to the data blocks from start on,
+ * growing the extent before it when they continue it
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
-  struct inode temp;
-  readi(ino, &temp);
+static int ext_map_run(struct inode *inode, int lblk, int len, int start) {
+	int leaf, n;
+	struct extent *e = ext_leaf(inode, lblk, &leaf, &n);
+	int k = ext_lookup(e, n, lblk);
+	if(k >= 0 && e[k].lblk + e[k].len == lblk && e[k].start + e[k].len == start){
+		e[k].len += len;
+		if(leaf >= 0) bio_write_meta(inode->extents[leaf].start, e);
+		map_changed[inode->ino] = 1;
+		return 0;
+	}
+	struct extent x = { lblk, len, start };
+	map_changed[inode->ino] = 1;
+	return ext_insert(inode, leaf, k+1, x, 0);
+}
+
+// Drop everything past the first nblocks file blocks from a sorted extent array, returns the blocks dropped
+static int ext_trunc_arr(struct extent *e, int *n, int nblocks, struct free_list *fl) {
+	int m = 0, freed = fl->n;
+	for(int k = 0; k < *n; k++){
+		struct extent x = e[k];
+		if(x.lblk >= nblocks){
+			free_list_add(fl, x.start, x.len);
+			continue;
+		}
+		if(x.lblk + x.len > nblocks){
+			int keep = nblocks - x.lblk;
+			free_list_add(fl, x.start + keep, x.len - keep);
+			x.len = keep;
+		}
+		e[m++] = x;
+	}
+	memset(&e[m], 0, (*n-m)*sizeof(struct extent));
+	*n = m;
+	return fl->n - freed;
+}
+
+static void ext_trunc(struct inode *inode, int nblocks, struct free_list *fl) {
+	struct extent *e = inode->extents;
+	int n = ext_count(e, NUM_EXTENTS);
+	prealloc_discard(inode->ino);
+	if(!(inode->flags & EXTENT_IDX_FL)){
+		ext_trunc_arr(e, &n, nblocks, fl);
+		return;
+	}
+	int m = 0;
+	for(int i = 0; i < n; i++){
+		struct extent x = e[i];
+		// Leaves that end before the next leaf starts need no changes
+		if(i + 1 < n && e[i+1].lblk <= nblocks){
+			e[m++] = x;
+			continue;
+		}
+		struct extent l[EXTENTS_PER_BLOCK+1];
+		memset(l, 0, sizeof(l));
+		int cnt = x.len;
+		memcpy(l, ptr_block(x.start, 0), cnt*sizeof(struct extent));
+		int dropped = ext_trunc_arr(l, &cnt, nblocks, fl);
+		ptr_block_drop(x.start);
+		if(cnt == 0){
+			free_list_add(fl, x.start, 1);
+			continue;
+		}
+		// a leaf whose last extent only got shorter changed too
+		if(dropped > 0) bio_write_meta(x.start, l);
+		x.len = cnt;
+		e[m++] = x;
+	}
+	memset(&e[m], 0, (n-m)*sizeof(struct extent));
+	if(m == 0) inode->flags &= ~EXTENT_IDX_FL;
+	else e[0].lblk = 0;
+}
+
+// Pointer-mapped (non-extent) part of bmap()
+static int ptr_bmap(struct inode *inode, int lblk, int alloc) {
+	// Step 1: The first NUM_DIRECT blocks use the direct pointers
+	if(lblk < NUM_DIRECT){
+		// Allocate a data block for a hole if the caller is going to write it
+		if(inode->direct_ptr[lblk] == 0 && alloc){
+			int blkno = get_avail_blkno(alloc == BMAP_RESERVED);
+			if(blkno == -1) return -1;
+			inode->direct_ptr[lblk] = blkno;
+		}
+		return inode->direct_ptr[lblk];
+	}
+	lblk -= NUM_DIRECT;
+	// Step 2: The next NUM_INDIRECT*PTRS_PER_BLOCK blocks go through single indirect blocks
+	int pblk;
+	if(lblk < NUM_INDIRECT*PTRS_PER_BLOCK){
+		pblk = bmap_top(&inode->indirect_ptr[lblk / PTRS_PER_BLOCK], alloc);
+		if(pblk <= 0) return pblk;
+		return bmap_ind(pblk, lblk % PTRS_PER_BLOCK, alloc, 0);
+	}
+	lblk -= NUM_INDIRECT*PTRS_PER_BLOCK;
+	// Step 3: The rest go through the double indirect block
+	if(lblk >= PTRS_PER_BLOCK*PTRS_PER_BLOCK) return -1;
+	pblk = bmap_top(&inode->indirect_ptr[NUM_INDIRECT], alloc);
+	if(pblk <= 0) return pblk;
+	pblk = bmap_ind(pblk, lblk / PTRS_PER_BLOCK, alloc, 1);
+	if(pblk <= 0) return pblk;
+	// Step 4: Return the data block number, 0 for a hole
+	return bmap_ind(pblk, lblk % PTRS_PER_BLOCK, alloc, 0);
+}
 
-  // Step 2: Get data block of current directory from inode
-	struct dirent dblock[num_dirent_per_block+1];
-	int flag = 0;
-	int i, j;
-	for(i = 0; i < 16; i++){
-		if(temp.direct_ptr[i] == 0) continue;
+/* 
+ * Data block holding file block lblk of inode, 0 for a hole; alloc fills holes
+ * in, from the free blocks or, with BMAP_RESERVED, from the caller's reservation
+ */
+int bmap(struct inode *inode, int lblk, int alloc) {
+	if(lblk < 0) return -1;
+	pthread_mutex_lock(&ptr_cache_lock);
+	int blkno = inode->flags & EXTENT_FL ? ext_bmap(inode, lblk, 0) : ptr_bmap(inode, lblk, 0);
+	// filling a hole changes the block map, which fdatasync has to commit
+	if(blkno == 0 && alloc){
+		blkno = inode->flags & EXTENT_FL ? ext_bmap(inode, lblk, alloc) : ptr_bmap(inode, lblk, alloc);
+		map_changed[inode->ino] = 1;
+	}
+	pthread_mutex_unlock(&ptr_cache_lock);
+	return blkno;
+}
+
+// Free everything past the first 'keep' blocks under an indirect pointer of the given depth
+static void trunc_ind(int *slot, int keep, int depth, struct free_list *fl) {
+	int span = depth == 1 ? 1 : PTRS_PER_BLOCK;
+	if(*slot == 0 || keep >= span*PTRS_PER_BLOCK) return;
+	if(keep < 0) keep = 0;
+	int ptrs[PTRS_PER_BLOCK];
+	memcpy(ptrs, ptr_block(*slot, 0), BLOCK_SIZE);
+	for(int i = keep / span; i < PTRS_PER_BLOCK; i++){
+		if(ptrs[i] == 0) continue;
+		if(depth == 1){
+			free_list_add(fl, ptrs[i], 1);
+			ptrs[i] = 0;
+		}
+		else trunc_ind(&ptrs[i], keep - i*span, 1, fl);
+	}
+	ptr_block_drop(*slot);
+	if(keep == 0){
+		free_list_add(fl, *slot, 1);
+		*slot = 0;
+	}
+	else bio_write_meta(*slot, ptrs);
+}
+
+/* 
+ * Release every data block of inode past its first nblocks blocks, with a
+ * single data bitmap update at the end
+ */
+void itrunc(struct inode *inode, int nblocks) {
+	struct free_list fl = { 0, 0, NULL };
+	pthread_mutex_lock(&ptr_cache_lock);
+	if(inode->flags & EXTENT_FL){
+		ext_trunc(inode, nblocks, &fl);
+	}
+	else{
+		for(int i = 0; i < NUM_DIRECT; i++){
+			if(i < nblocks || inode->direct_ptr[i] == 0) continue;
+			free_list_add(&fl, inode->direct_ptr[i], 1);
+			inode->direct_ptr[i] = 0;
+		}
+		for(int k = 0; k < NUM_INDIRECT; k++){
+			trunc_ind(&inode->indirect_ptr[k], nblocks - NUM_DIRECT - k*PTRS_PER_BLOCK, 1, &fl);
+		}
+		trunc_ind(&inode->indirect_ptr[NUM_INDIRECT], nblocks - NUM_DIRECT - NUM_INDIRECT*PTRS_PER_BLOCK, 2, &fl);
+	}
+	free_list_commit(&fl);
+	pthread_mutex_unlock(&ptr_cache_lock);
+}
+
+
+/*
+ * Delayed allocation: tfs_write copies file data into the file's dirty blocks
+ * and leaves them unmapped. delalloc_flush() allocates and writes them all in
+ * one pass, in file block order, on flush and release, once the file has
+ * DELALLOC_BLOCKS dirty blocks, or when the oldest is DELALLOC_AGE seconds
+ * old, so small appends end up as one contiguous allocation. A slot's
+ * contents belong to the file's inode lock; which file owns a slot is under
+ * delalloc_lock. Each dirty block that is not mapped yet holds a reservation
+ * of reserve_units() blocks, for itself and the pointer or extent blocks that
+ * mapping it may take, which no other allocation can use; the flush maps it
+ * from there and hands back what was not needed.
+ */
+struct delalloc {
+	int ino;						/* owner, -1 if the slot is free */
+	int n;							/* dirty blocks */
+	int reserved;					/* blocks reserved for those that are not mapped yet */
+	time_t dirtied;					/* when the oldest dirty block was written */
+	int lblk[DELALLOC_BLOCKS];		/* file block of each dirty block */
+	char *data[DELALLOC_BLOCKS];
+};
+static struct delalloc delalloc_tab[DELALLOC_SLOTS];
+static pthread_mutex_t delalloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct delalloc *delalloc_find(int ino) {
+	struct delalloc *d = NULL;
+	pthread_mutex_lock(&delalloc_lock);
+	for(int i = 0; i < DELALLOC_SLOTS && d == NULL; i++){
+		if(delalloc_tab[i].ino == ino) d = &delalloc_tab[i];
+	}
+	pthread_mutex_unlock(&delalloc_lock);
+	return d;
+}
+
+// The file's slot, taking a free one if needed; NULL if every slot is in use
+static struct delalloc *delalloc_get(int ino) {
+	struct delalloc *d = delalloc_find(ino);
+	if(d != NULL) return d;
+	pthread_mutex_lock(&delalloc_lock);
+	for(int i = 0; i < DELALLOC_SLOTS && d == NULL; i++){
+		if(delalloc_tab[i].ino == -1) d = &delalloc_tab[i];
+	}
+	if(d != NULL){
+		d->ino = ino;
+		d->n = 0;
+		d->reserved = 0;
+	}
+	pthread_mutex_unlock(&delalloc_lock);
+	return d;
+}
+
+static char *delalloc_block(struct delalloc *d, int lblk) {
+	for(int k = 0; k < d->n; k++){
+		if(d->lblk[k] == lblk) return d->data[k];
+	}
+	return NULL;
+}
+
+static void delalloc_release(struct delalloc *d) {
+	for(int k = 0; k < d->n; k++) bio_buf_put(d->data[k]);
+	if(d->reserved > 0) unreserve_blocks(d->reserved);
+	d->n = 0;
+	d->reserved = 0;
+	pthread_mutex_lock(&delalloc_lock);
+	d->ino = -1;
+	pthread_mutex_unlock(&delalloc_lock);
+}
+
+/* 
+ * Allocate and write the dirty blocks of inode, the caller holds its inode
+ * lock exclusively. Writes the inode back too.
+ */
+static int delalloc_flush(struct inode *inode) {
+	struct delalloc *d = delalloc_find(inode->ino);
+	if(d == NULL){
+		return 0;
+	}
+	// Step 1: Sort the dirty blocks by file block
+	for(int k = 1; k < d->n; k++){
+		int lblk = d->lblk[k];
+		char *data = d->data[k];
+		int j = k;
+		for(; j > 0 && d->lblk[j-1] > lblk; j--){
+			d->lblk[j] = d->lblk[j-1];
+			d->data[j] = d->data[j-1];
+		}
+		d->lblk[j] = lblk;
+		d->data[j] = data;
+	}
+	// Step 2: Map the blocks in order, so they come out contiguous. A block that is not mapped
+	// yet takes its blocks out of its own reservation and hands back the rest once it is mapped;
+	// one that cannot be mapped stays in the slot with its reservation
+	int units = reserve_units(inode);
+	struct bio_req reqs[DELALLOC_BLOCKS];
+	int n = 0, m = 0, retstat = 0;
+	for(int k = 0; k < d->n; k++){
+		int blkno = bmap(inode, d->lblk[k], 0);
+		if(blkno <= 0){
+			blkno = bmap(inode, d->lblk[k], BMAP_RESERVED);
+			if(blkno > 0){
+				d->reserved -= units;
+				unreserve_blocks(units);
+			}
+		}
+		if(blkno <= 0){
+			d->lblk[m] = d->lblk[k];
+			d->data[m++] = d->data[k];
+			retstat = -ENOSPC;
+			continue;
+		}
+		reqs[n++] = (struct bio_req){ blkno, d->data[k], 1, 0 };
+	}
+	// Step 3: Write them with one submission, and free the slot unless blocks were left in it
+	bio_submit(reqs, n);
+	writei(inode->ino, inode);
+	for(int k = 0; k < n; k++) bio_buf_put(reqs[k].buf);
+	d->n = m;
+	if(m == 0) delalloc_release(d);
+	return retstat;
+}
+
+/* 
+ * Drop the dirty blocks of a file that is being removed or cut short
+ */
+static void delalloc_discard(int ino) {
+	struct delalloc *d = delalloc_find(ino);
+	if(d != NULL) delalloc_release(d);
+}
+
+/* 
+ * Drop the dirty blocks of inode from file block nblocks on, the file is
+ * being cut short; the caller holds its inode lock exclusively
+ */
+static void delalloc_trunc(struct inode *inode, int nblocks) {
+	struct delalloc *d = delalloc_find(inode->ino);
+	if(d == NULL){
+		return;
+	}
+	int m = 0;
+	for(int k = 0; k < d->n; k++){
+		if(d->lblk[k] < nblocks){
+			d->lblk[m] = d->lblk[k];
+			d->data[m++] = d->data[k];
+			continue;
+		}
+		// a block that is not mapped gives its reservation back
+		if(bmap(inode, d->lblk[k], 0) <= 0){
+			d->reserved -= reserve_units(inode);
+			unreserve_blocks(reserve_units(inode));
+		}
+		bio_buf_put(d->data[k]);
+	}
+	d->n = m;
+	if(m == 0) delalloc_release(d);
+}
+
+/* 
+ * Flush every file with dirty blocks, only used once no handler can run
+ */
+static void delalloc_flush_all() {
+	for(int i = 0; i < DELALLOC_SLOTS; i++){
+		if(delalloc_tab[i].ino == -1) continue;
+		struct inode inode;
+		readi(delalloc_tab[i].ino, &inode);
+		if(delalloc_flush(&inode) < 0){
+			printf("Delayed blocks of inode %d could not be allocated\n", inode.ino);
+			delalloc_discard(inode.ino);
+		}
+	}
+}
+
+/* 
+ * Copy n bytes to block lblk of inode at boff: into a dirty block of d, or
+ * straight to an allocated block when d is NULL. Returns -1 if the disk is full.
+ */
+static int write_block(struct inode *inode, struct delalloc *d, int lblk, int boff, const char *src, size_t n) {
+	char *block = d != NULL ? delalloc_block(d, lblk) : NULL;
+	if(block == NULL){
+		int blkno = bmap(inode, lblk, 0);
+		int fresh = blkno <= 0;
+		if(d != NULL){
+			// a block that is not mapped yet needs a reservation
+			if(fresh && !reserve_blocks(reserve_units(inode))) return -1;
+			block = bio_buf_get();
+			if(d->n == 0) d->dirtied = time(NULL);
+			d->lblk[d->n] = lblk;
+			d->data[d->n] = block;
+			d->n++;
+			if(fresh) d->reserved += reserve_units(inode);
+		}
 		else{
-			bio_read(temp.direct_ptr[i], (void*)dblock);
-			for(j = 0; j < num_dirent_per_block; j++){
-				//dirent j from block i matches dirent we're trying to create
-				if((dblock[j].len == name_len) && (strcmp(dblock[j].name, fname)==0) && (dblock[j].valid == 1)){
-					flag = 1;
-					break;
-				}
+			blkno = bmap(inode, lblk, 1);
+			if(blkno <= 0) return -1;
+			block = bio_buf_get();
+		}
+		// only partially overwritten blocks need their old contents
+		if(n < BLOCK_SIZE){
+			if(fresh) memset(block, 0, BLOCK_SIZE);
+			else bio_read(blkno, block);
+		}
+		if(d == NULL){
+			memcpy(block + boff, src, n);
+			bio_write(blkno, block);
+			bio_buf_put(block);
+			return 0;
+		}
+	}
+	memcpy(block + boff, src, n);
+	return 0;
+}
+
+/* 
+ * Map n whole blocks of inode from lblk on, allocating the missing ones, and
+ * write them from src with a single submission. Returns the blocks written,
+ * fewer than n if the disk filled up.
+ */
+static int write_run(struct inode *inode, int lblk, const char *src, int n) {
+	struct bio_req *reqs = malloc(n * sizeof(struct bio_req));
+	int k = 0;
+	for(; k < n; k++){
+		int blkno = bmap(inode, lblk + k, 1);
+		if(blkno <= 0) break;
+		reqs[k] = (struct bio_req){ blkno, (char *)src + (size_t)k * BLOCK_SIZE, 1, 0 };
+	}
+	bio_submit(reqs, k);
+	free(reqs);
+	return k;
+}
+
+// What holes read as
+static const char zero_block[BLOCK_SIZE];
+
+/* 
+ * Map n whole blocks of inode from lblk on, allocating the missing ones, and
+ * copy them from bufv straight into the disk file, one copy per run of
+ * consecutive blocks; the kernel splices when bufv is a pipe. Returns the
+ * blocks written. After a short copy, the blocks it allocated past those
+ * are zeroed.
+ */
+static int write_run_fd(struct inode *inode, int lblk, struct fuse_bufvec *bufv, int n) {
+	int *blknos = malloc(n * sizeof(int));
+	char *fresh = malloc(n);
+	int k = 0;
+	for(; k < n; k++){
+		fresh[k] = bmap(inode, lblk + k, 0) <= 0;
+		blknos[k] = bmap(inode, lblk + k, 1);
+		if(blknos[k] <= 0) break;
+	}
+	// a cached copy would be stale, and a dirty one would later overwrite the new data
+	bio_drop(blknos, k);
+	int done = 0;
+	while(done < k){
+		int run = 1;
+		while(done + run < k && blknos[done + run] == blknos[done] + run) run++;
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT((size_t)run * BLOCK_SIZE);
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = bio_fd();
+		dst.buf[0].pos = (off_t)blknos[done] * BLOCK_SIZE;
+		if(fuse_buf_copy(&dst, bufv, 0) != (ssize_t)run * BLOCK_SIZE) break;
+		done += run;
+	}
+	// and so would a copy the readahead thread read in meanwhile
+	bio_drop(blknos, k);
+	// the blocks a short copy did not reach must not show what they held before they were allocated
+	if(done < k){
+		struct bio_req *reqs = malloc((k - done) * sizeof(struct bio_req));
+		int nz = 0;
+		for(int j = done; j < k; j++){
+			if(fresh[j]) reqs[nz++] = (struct bio_req){ blknos[j], (char *)zero_block, 1, 0 };
+		}
+		bio_submit(reqs, nz);
+		free(reqs);
+	}
+	free(fresh);
+	free(blknos);
+	return done;
+}
+
+/* 
+ * Write size bytes of src to inode at offset. The data is copied into the
+ * file's dirty blocks, which are allocated when flushed; without a free
+ * delalloc slot, blocks are allocated and written now. Returns the bytes
+ * written, fewer if the disk filled up.
+ */
+static size_t write_data(struct inode *inode, const char *src, size_t size, off_t offset) {
+	struct delalloc *d = delalloc_get(inode->ino);
+	size_t done = 0;
+	while(done < size){
+		int lblk = (offset + done) / BLOCK_SIZE;
+		int boff = (offset + done) % BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - boff;
+		if(n > size - done) n = size - done;
+		// more whole blocks than a dirty slot holds are allocated and written as one batch,
+		// after any dirty blocks of the file so those cannot land on top
+		int whole = boff == 0 ? (size - done) / BLOCK_SIZE : 0;
+		if(whole >= DELALLOC_BLOCKS){
+			if(d != NULL && d->n > 0){
+				if(delalloc_flush(inode) < 0) break;
+				d = delalloc_get(inode->ino);
+			}
+			int written = write_run(inode, lblk, src + done, whole);
+			done += (size_t)written * BLOCK_SIZE;
+			if(written < whole) break;
+			continue;
+		}
+		// a file with a full set of dirty blocks flushes them before taking another
+		if(d != NULL && d->n == DELALLOC_BLOCKS && delalloc_block(d, lblk) == NULL){
+			if(delalloc_flush(inode) < 0) break;
+			d = delalloc_get(inode->ino);
+		}
+		if(write_block(inode, d, lblk, boff, src + done, n) == -1) break;
+		done += n;
+	}
+	if(d != NULL && d->n == 0) delalloc_release(d);
+	return done;
+}
+
+/* 
+ * Take the next n bytes of bufv as one buffer: in place when they are in
+ * memory, otherwise copied into *tmp, e.g. from a pipe the kernel spliced
+ * the request into. NULL if bufv runs short.
+ */
+static const char *buf_take(struct fuse_bufvec *bufv, size_t n, char **tmp) {
+	struct fuse_buf *b = &bufv->buf[bufv->idx];
+	if(bufv->idx < bufv->count && !(b->flags & FUSE_BUF_IS_FD) && b->size - bufv->off >= n){
+		const char *p = (const char *)b->mem + bufv->off;
+		bufv->off += n;
+		if(bufv->off == b->size){
+			bufv->idx++;
+			bufv->off = 0;
+		}
+		return p;
+	}
+	*tmp = realloc(*tmp, n);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(n);
+	dst.buf[0].mem = *tmp;
+	if(fuse_buf_copy(&dst, bufv, 0) != (ssize_t)n) return NULL;
+	return *tmp;
+}
+
+/* 
+ * Fill the holes among n file blocks of inode from lblk on with zeroed data
+ * blocks, each hole taken as one contiguous run when the disk has one.
+ * Returns -ENOSPC if the disk filled up, -EIO if zeroing failed; what was
+ * mapped by then stays.
+ */
+static int falloc_blocks(struct inode *inode, int lblk, int n) {
+	int *blknos = malloc(n * sizeof(int));
+	int nz = 0, retstat = 0;
+	// the file's own preallocation window sits where its holes should go
+	prealloc_discard(inode->ino);
+	for(int k = 0; k < n && retstat == 0; ){
+		if(bmap(inode, lblk + k, 0) > 0){
+			k++;
+			continue;
+		}
+		// Step 1: Pointer mapped files go block by block, next-fit keeps them together
+		if(!(inode->flags & EXTENT_FL)){
+			int blkno = bmap(inode, lblk + k, 1);
+			if(blkno <= 0) retstat = -ENOSPC;
+			else blknos[nz++] = blkno;
+			k++;
+			continue;
+		}
+		// Step 2: Otherwise claim the whole hole at once, aiming right after the block before it
+		int len = 1;
+		while(k + len < n && bmap(inode, lblk + k + len, 0) <= 0) len++;
+		int prev = lblk + k > 0 ? bmap(inode, lblk + k - 1, 0) : 0;
+		int got;
+		int start = get_avail_range(prev > 0 ? prev + 1 : 0, len, &got);
+		if(start == -1){
+			retstat = -ENOSPC;
+			break;
+		}
+		// Step 3: and map it with a single extent
+		pthread_mutex_lock(&ptr_cache_lock);
+		int mapped = ext_map_run(inode, lblk + k, got, start);
+		pthread_mutex_unlock(&ptr_cache_lock);
+		if(mapped == -1){
+			struct free_list fl = { 0, 0, NULL };
+			free_list_add(&fl, start, got);
+			free_list_commit(&fl);
+			retstat = -ENOSPC;
+			break;
+		}
+		for(int i = 0; i < got; i++) blknos[nz++] = start + i;
+		k += got;
+	}
+	// Step 4: Zero the new blocks on the disk a run at a time, so nothing a block held before shows
+	// through; they bypass the block cache, which a large preallocation would only flush out
+	for(int i = 0, j; i < nz; i = j){
+		for(j = i + 1; j < nz && blknos[j] == blknos[j-1] + 1; j++);
+		if(bio_zero(blknos[i], j - i) < 0 && retstat == 0) retstat = -EIO;
+	}
+	free(blknos);
+	return retstat;
+}
+
+/*
+ * Dentry cache: (parent ino, name) -> child ino for tfs_lookup().
+ * ino -1 is a negative entry remembering that the name does not exist.
+ * dir_add() and dir_remove() keep it up to date.
+ */
+struct dcache_ent {
+	int used;						/* entry holds a lookup result */
+	int ref;						/* CLOCK reference bit */
+	uint16_t parent;				/* directory the name was looked up in */
+	int ino;						/* child inode number, -1 if the name does not exist */
+	uint16_t len;					/* length of name */
+	char name[208];
+	struct dcache_ent *hnext;		/* next entry in the hash chain */
+};
+static struct dcache_ent dcache[DCACHE_SIZE];
+static struct dcache_ent *dhash[DCACHE_SIZE];
+static int dcache_hand = 0;
+
+static unsigned int dcache_hash(uint16_t parent, const char *name, size_t len) {
+	unsigned int h = 2166136261u ^ parent;
+	for(size_t i = 0; i < len; i++){
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h % DCACHE_SIZE;
+}
+
+static struct dcache_ent *dcache_find(uint16_t parent, const char *name, size_t len) {
+	struct dcache_ent *e = dhash[dcache_hash(parent, name, len)];
+	while(e != NULL && (e->parent != parent || e->len != len || memcmp(e->name, name, len) != 0)) e = e->hnext;
+	return e;
+}
+
+static void dcache_unhash(struct dcache_ent *e) {
+	struct dcache_ent **p = &dhash[dcache_hash(e->parent, e->name, e->len)];
+	while(*p != e) p = &(*p)->hnext;
+	*p = e->hnext;
+	e->used = 0;
+}
+
+/* 
+ * Look up name in directory parent, returns 1 and sets *ino (-1 for a known miss) on a hit
+ */
+int dcache_lookup(uint16_t parent, const char *name, size_t len, int *ino) {
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_ent *e = dcache_find(parent, name, len);
+	if(e == NULL){
+		pthread_mutex_unlock(&dcache_lock);
+		return 0;
+	}
+	e->ref = 1;
+	*ino = e->ino;
+	pthread_mutex_unlock(&dcache_lock);
+	return 1;
+}
+
+/* 
+ * Record that name in directory parent is inode ino, -1 if it does not exist
+ */
+void dcache_enter(uint16_t parent, const char *name, size_t len, int ino) {
+	if(len >= sizeof(dcache[0].name)) return;
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_ent *e = dcache_find(parent, name, len);
+	if(e == NULL){
+		for(;;){
+			e = &dcache[dcache_hand];
+			dcache_hand = (dcache_hand + 1) % DCACHE_SIZE;
+			if(!e->used) break;
+			if(e->ref){
+				e->ref = 0;
+				continue;
 			}
+			dcache_unhash(e);
+			break;
 		}
-		if(flag == 1) break;
+		e->parent = parent;
+		e->len = len;
+		memcpy(e->name, name, len);
+		e->name[len] = '\0';
+		unsigned int h = dcache_hash(parent, name, len);
+		e->hnext = dhash[h];
+		dhash[h] = e;
+		e->used = 1;
 	}
-	if(flag == 0){
+	e->ino = ino;
+	e->ref = 1;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/* 
+ * Forget every entry looked up in directory parent, used when its inode number is freed
+ */
+void dcache_purge(uint16_t parent) {
+	pthread_mutex_lock(&dcache_lock);
+	for(int i = 0; i < DCACHE_SIZE; i++){
+		if(dcache[i].used && dcache[i].parent == parent) dcache_unhash(&dcache[i]);
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_reset() {
+	memset(dcache, 0, sizeof(dcache));
+	memset(dhash, 0, sizeof(dhash));
+	dcache_hand = 0;
+}
+
+
+/* 
+ * directory operations
+ *
+ * A directory is a run of blocks of directory entries. Once a directory
+ * needs more than DIR_INDEX_THRESHOLD blocks it is converted to an indexed
+ * directory (DIR_INDEX_FL): block 0 becomes a struct dx_root mapping name
+ * hash ranges to leaf blocks, so a lookup reads one leaf instead of every
+ * block, and a full leaf is split in two by hash.
+ */
+
+// Name hash (FNV-1a) used to place entries of indexed directories
+static uint32_t name_hash(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+	for(size_t i = 0; i < len; i++){
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Entries inside one directory block, pos is the byte offset of a record
+ */
+#define DREC(blk, pos) ((struct dirent_rec *)((char *)(blk) + (pos)))
+
+static void dblk_init(void *blk) {
+	memset(blk, 0, BLOCK_SIZE);
+	DREC(blk, 0)->rec_len = BLOCK_SIZE;
+}
+
+// Offset of the last record, it holds the free space of the block
+static int dblk_last(void *blk) {
+	int pos = 0;
+	while(pos + DREC(blk, pos)->rec_len < BLOCK_SIZE && DREC(blk, pos)->rec_len != 0) pos += DREC(blk, pos)->rec_len;
+	return pos;
+}
+
+// Offset of fname in the block, -1 if it is not there
+static int dblk_find(void *blk, const char *fname, size_t name_len) {
+	for(int pos = 0; pos < BLOCK_SIZE && DREC(blk, pos)->rec_len != 0; pos += DREC(blk, pos)->rec_len){
+		struct dirent_rec *r = DREC(blk, pos);
+		if(r->name_len == name_len && memcmp(r->name, fname, name_len) == 0) return pos;
+	}
+	return -1;
+}
+
+// Offset that can take an entry with a name of name_len, -1 if the block is full
+static int dblk_room(void *blk, size_t name_len) {
+	int pos = dblk_last(blk);
+	struct dirent_rec *r = DREC(blk, pos);
+	int used = r->name_len == 0 ? 0 : DIRENT_REC_LEN(r->name_len);
+	if(r->rec_len - used < DIRENT_REC_LEN(name_len)) return -1;
+	return pos + used;
+}
+
+// Store an entry at an offset returned by dblk_room, splitting the slack of the last record
+static void dblk_put(void *blk, int pos, uint16_t ino, const char *fname, size_t name_len) {
+	int last = dblk_last(blk);
+	struct dirent_rec *r = DREC(blk, pos);
+	if(pos != last){
+		r->rec_len = last + DREC(blk, last)->rec_len - pos;
+		DREC(blk, last)->rec_len = pos - last;
+	}
+	r->ino = ino;
+	r->name_len = name_len;
+	memcpy(r->name, fname, name_len);
+}
+
+// Remove the record at pos and slide the ones after it down, so the block stays packed
+static void dblk_del(void *blk, int pos) {
+	int len = DREC(blk, pos)->rec_len;
+	if(pos + len >= BLOCK_SIZE){
+		if(pos == 0){
+			dblk_init(blk);
+			return;
+		}
+		int prev = 0;
+		while(prev + DREC(blk, prev)->rec_len < pos) prev += DREC(blk, prev)->rec_len;
+		DREC(blk, prev)->rec_len += len;
+		return;
+	}
+	int last = dblk_last(blk);
+	memmove((char *)blk + pos, (char *)blk + pos + len, BLOCK_SIZE - pos - len);
+	memset((char *)blk + BLOCK_SIZE - len, 0, len);
+	DREC(blk, last - len)->rec_len += len;
+}
+
+// Copy out the first entry at or after pos, returns the position after it or -1 at the end of the block
+static int dblk_next(void *blk, int pos, struct dirent *d) {
+	while(pos < BLOCK_SIZE && DREC(blk, pos)->rec_len != 0){
+		struct dirent_rec *r = DREC(blk, pos);
+		pos += r->rec_len;
+		if(r->name_len != 0){
+			d->ino = r->ino;
+			d->valid = 1;
+			memcpy(d->name, r->name, r->name_len);
+			d->name[r->name_len] = '\0';
+			d->len = r->name_len;
+			return pos;
+		}
+	}
+	return -1;
+}
+
+// Number of blocks in a directory, old directories without a size only use direct pointers
+static int dir_nblocks(struct inode *dir) {
+	if(dir->size > 0) return dir->size / BLOCK_SIZE;
+	int n = 0;
+	for(int i = 0; i < NUM_DIRECT; i++){
+		if(dir->direct_ptr[i] != 0) n = i + 1;
+	}
+	return n;
+}
+
+// Free slot hint: the block of a linear directory that last had room, kept with the cached inode
+static int dir_hint_get(uint16_t ino) {
+	pthread_mutex_lock(&icache_lock);
+	struct icache_ent *e = ihash[ino % ICACHE_SIZE];
+	while(e != NULL && e->inode.ino != ino) e = e->hnext;
+	int hint = e != NULL ? e->dir_hint : 0;
+	pthread_mutex_unlock(&icache_lock);
+	return hint;
+}
+
+static void dir_hint_set(uint16_t ino, int lblk) {
+	pthread_mutex_lock(&icache_lock);
+	struct icache_ent *e = ihash[ino % ICACHE_SIZE];
+	while(e != NULL && e->inode.ino != ino) e = e->hnext;
+	if(e != NULL) e->dir_hint = lblk;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+// Index entry whose hash range holds hash
+static int dx_search(struct dx_root *root, uint32_t hash) {
+	int lo = 1, hi = root->count - 1, k = 0;
+	while(lo <= hi){
+		int mid = (lo + hi) / 2;
+		if(root->entries[mid].hash <= hash){
+			k = mid;
+			lo = mid + 1;
+		}
+		else hi = mid - 1;
+	}
+	return k;
+}
+
+/* 
+ * Find fname in dir, returns the data block holding it (and its lblk and slot) or -1
+ */
+static int dir_lookup(struct inode *dir, const char *fname, size_t name_len, int *lblk, int *pos) {
+	char dblock[BLOCK_SIZE];
+	if(dir->flags & DIR_INDEX_FL){
+		// Only the leaf for the name's hash can hold it
+		struct dx_root *root = bread(bmap(dir, 0, 0), dblock);
+		*lblk = root->entries[dx_search(root, name_hash(fname, name_len))].lblk;
+		int blkno = bmap(dir, *lblk, 0);
+		if(blkno <= 0) return -1;
+		*pos = dblk_find(bread(blkno, dblock), fname, name_len);
+		return *pos == -1 ? -1 : blkno;
+	}
+	int n = dir_nblocks(dir);
+	for(*lblk = 0; *lblk < n; (*lblk)++){
+		int blkno = bmap(dir, *lblk, 0);
+		if(blkno <= 0) continue;
+		*pos = dblk_find(bread(blkno, dblock), fname, name_len);
+		if(*pos != -1) return blkno;
+	}
+	return -1;
+}
+
+/* 
+ * Call fn on every entry of dir, stops early and returns 1 if fn returns nonzero
+ */
+static int dir_iterate(struct inode *dir, int (*fn)(struct dirent *, void *), void *arg) {
+	char dblock[BLOCK_SIZE];
+	struct dirent d;
+	int first = 0;
+	if(dir->flags & DIR_INDEX_FL){
+		// "." and ".." live in the index root
+		struct dx_root *root = bread(bmap(dir, 0, 0), dblock);
+		memset(&d, 0, sizeof(struct dirent));
+		d.valid = 1;
+		d.ino = root->dot;
+		uint16_t dotdot = root->dotdot;
+		strcpy(d.name, ".");
+		d.len = 1;
+		if(fn(&d, arg)) return 1;
+		d.ino = dotdot;
+		strcpy(d.name, "..");
+		d.len = 2;
+		if(fn(&d, arg)) return 1;
+		first = 1;
+	}
+	// Read the entry blocks READ_BATCH at a time into aligned buffers, mapped blocks are used in place
+	void *bufs[READ_BATCH];
+	for(int k = 0; k < READ_BATCH; k++) bufs[k] = bio_buf_get();
+	int n = dir_nblocks(dir);
+	int stop = 0;
+	for(int lblk = first; lblk < n && !stop; lblk += READ_BATCH){
+		char *blks[READ_BATCH];
+		int blknos[READ_BATCH];
+		int nblks = 0, nread = 0;
+		for(int k = lblk; k < n && k < lblk + READ_BATCH; k++){
+			int blkno = bmap(dir, k, 0);
+			if(blkno <= 0) continue;
+			blks[nblks] = bio_map(blkno);
+			if(blks[nblks] == NULL){
+				blks[nblks] = bufs[nread];
+				blknos[nread++] = blkno;
+			}
+			nblks++;
+		}
+		bio_readv(blknos, bufs, nread);
+		for(int k = 0; k < nblks && !stop; k++){
+			int pos = 0;
+			while(!stop && (pos = dblk_next(blks[k], pos, &d)) != -1){
+				stop = fn(&d, arg);
+			}
+		}
+	}
+	for(int k = 0; k < READ_BATCH; k++) bio_buf_put(bufs[k]);
+	return stop ? 1 : 0;
+}
+
+// Add a block at the end of dir, returns its data block number
+static int dir_grow(struct inode *dir, int *lblk) {
+	*lblk = dir_nblocks(dir);
+	int blkno = bmap(dir, *lblk, 1);
+	if(blkno <= 0) return -1;
+	dir->size = (*lblk + 1) * BLOCK_SIZE;
+	return blkno;
+}
+
+// Split a full leaf of an indexed directory in two by hash, adding fname on the way
+static int dx_split(struct inode *dir, struct dx_root *root, int k, void *leaf, uint16_t f_ino, const char *fname, size_t name_len) {
+	struct dx_tmp {
+		uint32_t hash;
+		struct dirent d;
+	};
+	if(root->count >= DX_ENTRIES) return -ENOSPC;
+	// Step 1: Collect the leaf's entries and the new one, sorted by hash
+	struct dx_tmp *all = malloc((num_dirent_per_block+1) * sizeof(struct dx_tmp));
+	int cnt = 0, pos = 0;
+	while((pos = dblk_next(leaf, pos, &all[cnt].d)) != -1){
+		all[cnt].hash = name_hash(all[cnt].d.name, all[cnt].d.len);
+		cnt++;
+	}
+	memset(&all[cnt].d, 0, sizeof(struct dirent));
+	all[cnt].d.ino = f_ino;
+	all[cnt].d.valid = 1;
+	memcpy(all[cnt].d.name, fname, name_len);
+	all[cnt].d.len = name_len;
+	all[cnt].hash = name_hash(fname, name_len);
+	cnt++;
+	for(int i = 1; i < cnt; i++){
+		struct dx_tmp t = all[i];
+		int j = i;
+		while(j > 0 && all[j-1].hash > t.hash){
+			all[j] = all[j-1];
+			j--;
+		}
+		all[j] = t;
+	}
+	// Step 2: Split where half of the bytes are used, entries with the same hash stay together
+	int total = 0, half = 0, mid = 0;
+	for(int i = 0; i < cnt; i++) total += DIRENT_REC_LEN(all[i].d.len);
+	while(mid < cnt - 1 && half + DIRENT_REC_LEN(all[mid].d.len) <= total / 2) half += DIRENT_REC_LEN(all[mid++].d.len);
+	if(mid == 0) mid = 1;
+	int m = mid;
+	while(mid < cnt && all[mid].hash == all[mid-1].hash) mid++;
+	if(mid == cnt){
+		mid = m;
+		while(mid > 0 && all[mid].hash == all[mid-1].hash) mid--;
+	}
+	// Step 3: Build both leaves before touching the disk
+	char lower[BLOCK_SIZE], upper[BLOCK_SIZE];
+	dblk_init(lower);
+	dblk_init(upper);
+	int fits = mid > 0;
+	for(int i = 0; fits && i < cnt; i++){
+		void *blk = i < mid ? lower : upper;
+		pos = dblk_room(blk, all[i].d.len);
+		if(pos == -1) fits = 0;
+		else dblk_put(blk, pos, all[i].d.ino, all[i].d.name, all[i].d.len);
+	}
+	int new_lblk;
+	int new_blk = fits ? dir_grow(dir, &new_lblk) : -1;
+	if(new_blk == -1){
+		free(all);
+		return -ENOSPC;
+	}
+	// Step 4: Write both leaves and add the new leaf to the index
+	memcpy(leaf, lower, BLOCK_SIZE);
+	int ret = 0;
+	if(bio_write_meta(bmap(dir, root->entries[k].lblk, 0), leaf) < 0) ret = -EIO;
+	if(bio_write_meta(new_blk, upper) < 0) ret = -EIO;
+	memmove(&root->entries[k+2], &root->entries[k+1], (root->count-k-1)*sizeof(struct dx_entry));
+	root->entries[k+1].hash = all[mid].hash;
+	root->entries[k+1].lblk = new_lblk;
+	root->count++;
+	if(bio_write_meta(bmap(dir, 0, 0), root) < 0) ret = -EIO;
+	free(all);
+	return ret;
+}
+
+// Add fname to an indexed directory, check says whether it may already exist.
+// Returns 0, -EEXIST, -ENOSPC or -EIO.
+static int dx_add(struct inode *dir, uint16_t f_ino, const char *fname, size_t name_len, int check) {
+	struct dx_root root;
+	char dblock[BLOCK_SIZE];
+	bio_read(bmap(dir, 0, 0), &root);
+	int k = dx_search(&root, name_hash(fname, name_len));
+	int blkno = bmap(dir, root.entries[k].lblk, 0);
+	bio_read(blkno, dblock);
+	if(check && dblk_find(dblock, fname, name_len) != -1) return -EEXIST;
+	int pos = dblk_room(dblock, name_len);
+	if(pos == -1) return dx_split(dir, &root, k, dblock, f_ino, fname, name_len);
+	dblk_put(dblock, pos, f_ino, fname, name_len);
+	return bio_write_meta(blkno, dblock) < 0 ? -EIO : 0;
+}
+
+static int dx_collect(struct dirent *d, void *arg) {
+	struct dirent **next = arg;
+	*(*next)++ = *d;
+	return 0;
+}
+
+// Turn a linear directory into an indexed one. The index is built in new blocks under a copy of the
+// inode and replaces the old blocks only once it is complete, so a failure leaves dir as it was.
+static int dx_convert(struct inode *dir) {
+	// Step 1: Save the entries
+	struct dirent *all = malloc((dir_nblocks(dir)*num_dirent_per_block+1) * sizeof(struct dirent));
+	if(all == NULL) return -1;
+	struct dirent *end = all;
+	dir_iterate(dir, dx_collect, &end);
+	// Step 2: Block 0 of an empty copy of the inode is the index root, block 1 the first leaf
+	// covering every hash
+	struct inode idx = *dir;
+	memset(idx.direct_ptr, 0, sizeof(idx.direct_ptr));
+	memset(idx.indirect_ptr, 0, sizeof(idx.indirect_ptr));
+	memset(idx.extents, 0, sizeof(idx.extents));
+	idx.flags &= ~EXTENT_IDX_FL;
+	idx.size = 0;
+	struct dx_root root;
+	char dblock[BLOCK_SIZE];
+	memset(&root, 0, sizeof(struct dx_root));
+	root.dot = dir->ino;
+	root.dotdot = dir->ino;
+	root.count = 1;
+	root.entries[0].hash = 0;
+	root.entries[0].lblk = 1;
+	int lblk, root_blk = dir_grow(&idx, &lblk);
+	int leaf_blk = root_blk == -1 ? -1 : dir_grow(&idx, &lblk);
+	int ret = leaf_blk == -1 ? -1 : 0;
+	if(ret == 0){
+		dblk_init(dblock);
+		bio_write_meta(leaf_blk, dblock);
+		for(struct dirent *d = all; d < end; d++){
+			if(strcmp(d->name, ".") == 0) root.dot = d->ino;
+			else if(strcmp(d->name, "..") == 0) root.dotdot = d->ino;
+		}
+		bio_write_meta(root_blk, &root);
+		idx.flags |= DIR_INDEX_FL;
+	}
+	// Step 3: Put the entries in through the index
+	for(struct dirent *d = all; ret == 0 && d < end; d++){
+		if(strcmp(d->name, ".") == 0 || strcmp(d->name, "..") == 0) continue;
+		ret = dx_add(&idx, d->ino, d->name, d->len, 0);
+	}
+	free(all);
+	// Step 4: Give the new blocks back on failure, otherwise release the old ones and switch over
+	if(ret != 0){
+		itrunc(&idx, 0);
 		return -1;
 	}
+	itrunc(dir, 0);
+	*dir = idx;
+	dir_hint_set(dir->ino, 0);
+	return 0;
+}
+
+// Add fname to a linear directory. Returns 0, -EEXIST, -ENOSPC or -EIO, or 1 if the directory is
+// out of room and should be indexed, unless 'grow' says to grow it past DIR_INDEX_THRESHOLD blocks instead. 'absent' means the caller
+// already knows fname is unused, so the search starts at the free slot hint and stops at the first
+// block with room.
+static int dir_linear_add(struct inode *dir, uint16_t f_ino, const char *fname, size_t name_len, int absent, int grow) {
+	char dblock[BLOCK_SIZE];
+	int n = dir_nblocks(dir);
+	int start = absent ? dir_hint_get(dir->ino) : 0;
+	if(start >= n) start = 0;
+	int room_lblk = -1, room_pos = -1, hole = -1;
+	for(int k = 0; k < n; k++){
+		int lblk = (start + k) % n;
+		int blkno = bmap(dir, lblk, 0);
+		if(blkno <= 0){
+			if(hole == -1) hole = lblk;
+			continue;
+		}
+		bio_read(blkno, dblock);
+		if(!absent && dblk_find(dblock, fname, name_len) != -1){
+			printf("Fname found\n");
+			return -EEXIST;
+		}
+		if(room_lblk == -1 && (room_pos = dblk_room(dblock, name_len)) != -1){
+			room_lblk = lblk;
+			if(absent) break;
+		}
+	}
+	int blkno;
+	if(room_lblk != -1){
+		blkno = bmap(dir, room_lblk, 0);
+		bio_read(blkno, dblock);
+	}
+	// Allocate a new data block for this directory while it is small enough
+	else{
+		room_lblk = hole != -1 ? hole : n;
+		if(room_lblk >= DIR_INDEX_THRESHOLD && !grow) return 1;
+		blkno = bmap(dir, room_lblk, 1);
+		if(blkno <= 0) return -ENOSPC;
+		if((room_lblk + 1) * BLOCK_SIZE > dir->size) dir->size = (room_lblk + 1) * BLOCK_SIZE;
+		dblk_init(dblock);
+		room_pos = dblk_room(dblock, name_len);
+	}
+	dblk_put(dblock, room_pos, f_ino, fname, name_len);
+	if(bio_write_meta(blkno, dblock) < 0) return -EIO;
+	dir_hint_set(dir->ino, room_lblk);
+	return 0;
+}
+
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
+  struct inode temp;
+  readi(ino, &temp);
+
+  // Step 2: Indexed directories keep "." and ".." in the index root
+  if((temp.flags & DIR_INDEX_FL) && name_len <= 2 && strncmp(fname, "..", name_len) == 0){
+	  struct dx_root rootbuf;
+	  int blkno = bmap(&temp, 0, 0);
+	  struct dx_root *root = bread(blkno, &rootbuf);
+	  dirent->ino = name_len == 1 ? root->dot : root->dotdot;
+	  dirent->valid = 1;
+	  memcpy(dirent->name, fname, name_len);
+	  dirent->name[name_len] = '\0';
+	  dirent->len = name_len;
+	  return blkno;
+  }
   // Step 3: Read directory's data block and check each directory entry.
   //If the name matches, then copy directory entry to dirent structure
-	dirent->ino = dblock[j].ino;
-	dirent->valid = 1;
-	for(int i = 0; i < name_len; i++){
-		dirent->name[i] = fname[i];
+	int lblk, pos;
+	int blkno = dir_lookup(&temp, fname, name_len, &lblk, &pos);
+	if(blkno == -1){
+		return -1;
 	}
-	dirent->len = name_len;
-
-	return temp.direct_ptr[i];
+	char dblock[BLOCK_SIZE];
+	dblk_next(bread(blkno, dblock), pos, dirent);
+	return blkno;
 }
 
+/*
+ * Returns 0, or -EEXIST if fname is already used, -ENAMETOOLONG, -ENOSPC or -EIO
+ */
 int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
 
 	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
 	// Step 2: Check if fname (directory name) is already used in other entries
-	struct dirent d;
+	// (the dentry cache may already know; otherwise this happens while looking for a free slot)
 	readi(dir_inode.ino, &dir_inode);
-	int i = dir_find(dir_inode.ino,fname, name_len,&d);
-	if(i !=  -1){
+	if(name_len >= sizeof(((struct dirent *)0)->name)) return -ENAMETOOLONG;
+	int cached;
+	int known = dcache_lookup(dir_inode.ino, fname, name_len, &cached);
+	if(known && cached != -1){
 		printf("Fname found\n");
-		return -1;
+		return -EEXIST;
 	}
-	else if(i ==-1){
-		//check if inode is made yet
-		struct inode n;
-		readi(f_ino, &n);
-		if(n.valid == 0){
-			n.ino = f_ino;
-			n.valid = 1;
-			n.size = 0;
-			n.type = DIR;
-			n.link = 2;
-			for(int i = 0; i < 16; i++){
-				n.direct_ptr[i] = 0;
-				if(i < 8) n.indirect_ptr[i] = 0;
-			}
-			n.direct_ptr[0] = get_avail_blkno();
-			struct dirent dblock[num_dirent_per_block+1];
-			bio_read(n.direct_ptr[0], &dblock);
-			dblock[0].ino = dir_inode.ino;
-			dblock[0].valid = 1;
-			dblock[0].name[0] = '.';
-			dblock[0].name[1] = '.';
-			dblock[0].name[2] = '\0';
-			dblock[0].len = 2;
-			dblock[1].ino = n.ino;
-			dblock[1].valid = 1;
-			dblock[1].name[0] = '.';
-			dblock[1].name[1] = '\0';
-			dblock[1].len = 1;
-			bio_write(n.direct_ptr[0], &dblock);
+	//check if inode is made yet
+	struct inode n;
+	readi(f_ino, &n);
+	int made = 0;
+	if(n.valid == 0){
+		memset(&n, 0, sizeof(struct inode));
+		n.ino = f_ino;
+		n.valid = 1;
+		n.size = BLOCK_SIZE;
+		n.type = DIR;
+		n.link = 2;
+		itouch(&n, 1);
+		n.vstat.st_atim = n.vstat.st_mtim;
+		n.direct_ptr[0] = get_avail_blkno(0);
+		if(n.direct_ptr[0] == -1) return -ENOSPC;
+		char dblock[BLOCK_SIZE];
+		dblk_init(dblock);
+		dblk_put(dblock, dblk_room(dblock, 2), dir_inode.ino, "..", 2);
+		dblk_put(dblock, dblk_room(dblock, 1), n.ino, ".", 1);
+		if(bio_write_meta(n.direct_ptr[0], dblock) < 0){
+			free_blkno(n.direct_ptr[0]);
+			return -EIO;
 		}
 		writei(f_ino, &n);
-		d.ino = f_ino;
-		d.valid = 1;
-		for(int i = 0; i < name_len; i++){
-			d.name[i] = fname[i];
-		}
-		d.name[i] = '\0';
-		d.len = name_len;
-		
-	}
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
-	int empty_block = -1;
-	int flag = 0;
-	int j;
-	struct dirent dblock[num_dirent_per_block+1];
-	for(i = 0; i < 16; i++){
-		if(dir_inode.direct_ptr[i] == 0){
-			if(empty_block == -1) empty_block = i;
-			continue;
-		}
-		else{
-			bio_read(dir_inode.direct_ptr[i], &dblock);
-			for(j = 0; j < num_dirent_per_block; j++){
-				if(dblock[j].valid == 0){
-					flag = 1;
-					break;
-				}
-			}
-			if(flag == 1) break;
-		}
+		made = 1;
 	}
-	if(flag == 0 && empty_block == -1){
-		printf("No room to add\n");
-		exit(1);
+	// Step 3: Add directory entry in dir_inode's data block and write to disk
+	int ret;
+	if(dir_inode.flags & DIR_INDEX_FL){
+		ret = dx_add(&dir_inode, f_ino, fname, name_len, !known);
 	}
-	else if(flag == 1){
-		dblock[j] = d;
+	else{
+		ret = dir_linear_add(&dir_inode, f_ino, fname, name_len, known, 0);
+		// Out of room, switch the directory to a hashed index; if that fails it stays linear
+		if(ret == 1){
+			if(dx_convert(&dir_inode) == 0) ret = dx_add(&dir_inode, f_ino, fname, name_len, 0);
+			else ret = dir_linear_add(&dir_inode, f_ino, fname, name_len, 1, 1);
+		}
 	}
-	// Allocate a new data block for this directory if it does not exist
-	else if(empty_block != -1){
-		i = empty_block;
-		dir_inode.direct_ptr[i] = get_avail_blkno();
-		bio_read(dir_inode.direct_ptr[i], dblock);
-		dblock[0] = d;
+	if(ret != 0){
+		writei(dir_inode.ino, &dir_inode);
+		if(made){
+			itrunc(&n, 0);
+			n.valid = 0;
+			writei(f_ino, &n);
+		}
+		return ret;
 	}
-	
 
 	// Update directory inode
 	dir_inode.link++;
+	itouch(&dir_inode, 1);
 	writei(dir_inode.ino, &dir_inode);
-	
-	// Write directory entry
-	bio_write(dir_inode.direct_ptr[i], &dblock);
+	dcache_enter(dir_inode.ino, fname, name_len, f_ino);
 	return 0;
 }
 
 int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
 
 	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	struct dirent d;
 	readi(dir_inode.ino, &dir_inode);
-	int t = dir_find(dir_inode.ino,fname, name_len,&d);
+	int lblk, pos;
+	int t = dir_lookup(&dir_inode, fname, name_len, &lblk, &pos);
 	// Step 2: Check if fname exist
 	if(t == -1){
 		printf("Fname does not exist\n");
 		return -1;
 	}
 	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
-	struct dirent dblock[num_dirent_per_block+1];
-	bio_read(t, &dblock);
-	for(int i = 0; i < num_dirent_per_block; i++){
-		if(dblock[i].len == name_len && strcmp(dblock[i].name,fname) == 0 && dblock[i].valid == 1){
-			dblock[i].valid = 0;
-		}
-	}
+	char dblock[BLOCK_SIZE];
+	bio_read(t, dblock);
+	dblk_del(dblock, pos);
+	bio_write_meta(t, dblock);
+	if(!(dir_inode.flags & DIR_INDEX_FL)) dir_hint_set(dir_inode.ino, lblk);
 	dir_inode.link--;
+	itouch(&dir_inode, 1);
 	writei(dir_inode.ino, &dir_inode);
-	bio_write(t, &dblock);
-	return 0;
-}
-
-/* 
- * namei operation
- */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-	char* token;
-	//cant tokenize a string literal (whatever that means) so need a copy
-	char* copy = malloc(strlen(path)+1);
-	strcpy(copy, path);
-	token = strtok(copy,"/");
-	struct dirent d;
-	d.ino = 0;
-	d.valid = 0;
-	while(token != NULL){
-		if(dir_find(d.ino, token, strlen(token), &d) == -1){
-			free(copy);
-			return -1;
-		}
-		token = strtok(NULL, "/");
-	}
-	//if looking for root directory
-	if(d.valid == 0){
-		if(dir_find(d.ino, ".", 1, &d) == -1){
-			free(copy);
-			return -1;
-		}
-	}
-	readi(d.ino, inode);
-	free(copy);
+	dcache_enter(dir_inode.ino, fname, name_len, -1);
 	return 0;
 }
 
@@ -371,6 +2061,7 @@ int tfs_mkfs() {
 	Superblock is first thing in file system
 	Then comes inode bitmap and data block bitbmap
 	Then comes inode region
+	Then comes the metadata journal
 	Then comes data block region
 	(Found on page 4 of Chapter 41 in textbook)
 	*/
@@ -379,17 +2070,20 @@ int tfs_mkfs() {
 
 	//write superblock information 
 	//sblock is a globally declared superblock, structure for a superblock is in tfs.h
-	sblock = malloc(BLOCK_SIZE);
-	inodebmap = malloc(BLOCK_SIZE * num_inodebmap_blocks);
-	dblockbmap = malloc(BLOCK_SIZE * num_dblockbmap_blocks);
+	sblock = calloc(1, BLOCK_SIZE);
+	inodebmap = calloc(num_inodebmap_blocks, BLOCK_SIZE);
+	dblockbmap = calloc(num_dblockbmap_blocks, BLOCK_SIZE);
 	sblock->magic_num = MAGIC_NUM; //Dont know what this does
 	sblock->max_inum = MAX_INUM; //Maximum number of inodes
 	sblock->max_dnum = MAX_DNUM; //Maximum number of datablocks
 	sblock->i_bitmap_blk = 1; //Start block of inode bitmap -- One block after superblock which will always take up 1 block
 	sblock->d_bitmap_blk = sblock->i_bitmap_blk + num_inodebmap_blocks; //Start block of datablock bitmap
 	sblock->i_start_blk = sblock->d_bitmap_blk + num_dblockbmap_blocks; //Start block of inodes
-	sblock->d_start_blk = sblock->i_start_blk + num_inode_blocks; //Start block of datablockprintf("Super block information read: \n");
+	sblock->j_start_blk = sblock->i_start_blk + num_inode_blocks; //Start block of the journal
+	sblock->j_blocks = JOURNAL_BLOCKS;
+	sblock->d_start_blk = sblock->j_start_blk + sblock->j_blocks; //Start block of datablockprintf("Super block information read: \n");
 	bio_write(0, sblock);
+	bio_journal(sblock->j_start_blk, sblock->j_blocks, 1);
 
 	// initialize inode bitmap	
 	for(int i = 0; i < MAX_INUM; i++){
@@ -413,35 +2107,443 @@ int tfs_mkfs() {
 		if(i < 8) root.indirect_ptr[i] = 0;
 	}
 	root.direct_ptr[0] = sblock->d_start_blk;
+	root.size = BLOCK_SIZE;
 	set_bitmap(dblockbmap, 0);
-	struct dirent dblock[num_dirent_per_block+1];
-	bio_read(root.direct_ptr[0], &dblock);
-	dblock[0].ino = 0;
-	dblock[0].valid = 1;
-	dblock[0].name[0] = '.';
-	dblock[0].name[1] = '\0';
-	dblock[0].len = 1;
-	bio_write(root.direct_ptr[0], &dblock);
+	char dblock[BLOCK_SIZE];
+	dblk_init(dblock);
+	dblk_put(dblock, dblk_room(dblock, 1), 0, ".", 1);
+	bio_write(root.direct_ptr[0], dblock);
 	writei(root.ino, &root);
 	// update inode for root directory
 	set_bitmap(inodebmap, 0);
-	//write inodebmap to disk
-	for(int i = sblock->i_bitmap_blk; i < sblock->i_bitmap_blk+num_inodebmap_blocks; i++){
-		bio_write(i, (inodebmap+((i-sblock->i_bitmap_blk)*BLOCK_SIZE)));
+	//write inodebmap and dblockbmap to disk
+	bitmap_io(1);
+	//commits only write the data they map, so the new file system goes in place now and the
+	//first commit's fdatasync makes it durable
+	bio_flush();
+	return 0;
+}
+
+
+/*
+ * Open files: tfs_open() and tfs_create() hang an open_file off fi->fh. It
+ * holds a pinned icache entry of the file, so its inode number is not handed
+ * out again while the file is open. It also follows how the file is read:
+ * each read that starts where the previous one ended doubles the readahead
+ * window, from RA_MIN_BLOCKS up to RA_MAX_BLOCKS, and any other read halves it.
+ */
+struct open_file {
+	struct inode *inode;		/* pinned with iget(), NULL if the inode cache was full */
+	pthread_mutex_t lock;
+	off_t next_off;				/* offset right after the last read */
+	int ra_window;				/* blocks to keep prefetched ahead of the reader */
+	int ra_end;					/* first block that has not been prefetched */
+};
+
+static void file_open(struct fuse_file_info *fi, uint16_t ino) {
+	struct open_file *f = calloc(1, sizeof(struct open_file));
+	f->inode = iget(ino);
+	pthread_mutex_init(&f->lock, NULL);
+	fi->fh = (uintptr_t)f;
+}
+
+static struct open_file *file_get(struct fuse_file_info *fi) {
+	return fi != NULL ? (struct open_file *)(uintptr_t)fi->fh : NULL;
+}
+
+/* 
+ * Note a read of [offset, offset+size) of inode and prefetch the blocks after
+ * it once less than half of the readahead window is left
+ */
+static void readahead(struct open_file *f, struct inode *inode, off_t offset, size_t size) {
+	int last = (offset + size - 1) / BLOCK_SIZE;
+	int nblocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	pthread_mutex_lock(&f->lock);
+	int sequential = offset == f->next_off;
+	f->next_off = offset + size;
+	if(!sequential){
+		f->ra_window /= 2;
+		f->ra_end = 0;
+		pthread_mutex_unlock(&f->lock);
+		return;
+	}
+	f->ra_window = f->ra_window < RA_MIN_BLOCKS ? RA_MIN_BLOCKS : f->ra_window * 2;
+	if(f->ra_window > RA_MAX_BLOCKS) f->ra_window = RA_MAX_BLOCKS;
+	int start = f->ra_end > last + 1 ? f->ra_end : last + 1;
+	int end = last + 1 + f->ra_window;
+	if(end > nblocks) end = nblocks;
+	if(start >= end || start - (last + 1) > f->ra_window / 2){
+		pthread_mutex_unlock(&f->lock);
+		return;
+	}
+	f->ra_end = end;
+	pthread_mutex_unlock(&f->lock);
+	int blknos[RA_MAX_BLOCKS];
+	int n = 0;
+	for(int lblk = start; lblk < end; lblk++){
+		int blkno = bmap(inode, lblk, 0);
+		if(blkno > 0) blknos[n++] = blkno;
+	}
+	bio_readahead(blknos, n);
+}
+
+
+/* 
+ * Flush the delayed blocks of file ino
+ */
+static int file_sync(uint16_t ino) {
+	if(delalloc_find(ino) == NULL){
+		return 0;
+	}
+	struct inode i;
+	ilock(ino, 1);
+	readi(ino, &i);
+	int retstat = i.valid == 1 ? delalloc_flush(&i) : 0;
+	iunlock(i.ino);
+	return retstat;
+}
+
+
+/*
+ * Transactions: every handler that changes metadata runs between tx_begin()
+ * and tx_end(), started before it takes any lock. journal_commit() lets no
+ * handler in and waits for the ones inside, so the metadata it logs never
+ * holds half an operation; everything done since the previous commit goes
+ * to the journal as one transaction. Callers that ask for a commit while one
+ * is being written wait for it and share it, as what they did is in it.
+ * tx_begin() commits first once the running transaction holds
+ * JOURNAL_TX_BLOCKS blocks or is JOURNAL_COMMIT_AGE seconds old.
+ */
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tx_cond = PTHREAD_COND_INITIALIZER;
+static int tx_updates;				// handlers inside a transaction
+static int tx_committing;			// a commit is waiting for them or being written
+static long tx_commits;				// commits done, waiters watch it change
+static int tx_result;				// what the last commit returned
+static time_t tx_started;			// when the running transaction started, 0 if none
+
+/* 
+ * Commit the running transaction, -1 if it could not be made durable
+ */
+static int journal_commit() {
+	// Step 1: A commit in progress has everything done before it started, wait for that one
+	pthread_mutex_lock(&tx_lock);
+	if(tx_committing){
+		long seen = tx_commits;
+		while(tx_commits == seen) pthread_cond_wait(&tx_cond, &tx_lock);
+		int retstat = tx_result;
+		pthread_mutex_unlock(&tx_lock);
+		return retstat;
+	}
+	// Step 2: Keep new handlers out and wait until the ones inside are done
+	tx_committing = 1;
+	while(tx_updates > 0) pthread_cond_wait(&tx_cond, &tx_lock);
+	pthread_mutex_unlock(&tx_lock);
+	// Step 3: Cached inodes go to their inode table blocks, then the block layer logs
+	// every held block and writes the data blocks mapped since the last commit ahead of
+	// the commit block, other dirty blocks are left to writeback; if that fails
+	// nothing was committed and fsync still finds the changed maps
+	isync();
+	int retstat = bio_commit();
+	if(retstat == 0) memset(map_changed, 0, sizeof(map_changed));
+	// Step 4: Let the handlers in again
+	pthread_mutex_lock(&tx_lock);
+	tx_committing = 0;
+	tx_started = 0;
+	tx_result = retstat;
+	tx_commits++;
+	pthread_cond_broadcast(&tx_cond);
+	pthread_mutex_unlock(&tx_lock);
+	return retstat;
+}
+
+static void tx_begin() {
+	pthread_mutex_lock(&tx_lock);
+	time_t now = time(NULL);
+	if(!tx_committing && tx_started != 0 && (now - tx_started >= JOURNAL_COMMIT_AGE || bio_held() >= JOURNAL_TX_BLOCKS)){
+		pthread_mutex_unlock(&tx_lock);
+		journal_commit();
+		pthread_mutex_lock(&tx_lock);
+	}
+	while(tx_committing) pthread_cond_wait(&tx_cond, &tx_lock);
+	if(tx_started == 0) tx_started = now;
+	tx_updates++;
+	pthread_mutex_unlock(&tx_lock);
+}
+
+static void tx_end() {
+	pthread_mutex_lock(&tx_lock);
+	if(--tx_updates == 0 && tx_committing) pthread_cond_broadcast(&tx_cond);
+	pthread_mutex_unlock(&tx_lock);
+}
+
+
+/*
+ * Background flusher: a thread started by tfs_init wakes every FLUSH_INTERVAL
+ * seconds and maps delayed blocks, commits the journal and writes back dirty
+ * blocks one interval before DELALLOC_AGE, JOURNAL_COMMIT_AGE and
+ * BCACHE_DIRTY_AGE run out, so the writers that check those limits seldom
+ * find anything to do. Once DIRTY_BACKGROUND_RATIO percent of the block cache
+ * is dirty, writers wake it early and it writes back every dirty block; at
+ * DIRTY_RATIO percent they also wait for that pass before writing more.
+ */
+static pthread_t flusher;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flusher_done = PTHREAD_COND_INITIALIZER;
+static int flusher_on;				// the thread is running
+static int flusher_stop;			// tfs_destroy waits for the thread to exit
+static int flusher_kick;			// a writer found too many dirty blocks
+static long flusher_passes;			// passes done, throttled writers watch it change
+
+/* 
+ * Map the delayed blocks of files whose oldest dirty block was written before 'before'
+ */
+static void delalloc_flush_aged(time_t before) {
+	int inos[DELALLOC_SLOTS];
+	int n = 0;
+	pthread_mutex_lock(&delalloc_lock);
+	for(int i = 0; i < DELALLOC_SLOTS; i++){
+		if(delalloc_tab[i].ino != -1) inos[n++] = delalloc_tab[i].ino;
+	}
+	pthread_mutex_unlock(&delalloc_lock);
+	for(int k = 0; k < n; k++){
+		// the slot may have been flushed or handed to another file since, look again under the inode lock
+		struct inode i;
+		tx_begin();
+		ilock(inos[k], 1);
+		struct delalloc *d = delalloc_find(inos[k]);
+		if(d != NULL && d->dirtied < before){
+			readi(inos[k], &i);
+			if(i.valid == 1) delalloc_flush(&i);
+		}
+		iunlock(inos[k]);
+		tx_end();
+	}
+}
+
+static void flush_pass() {
+	// Step 1: Map the delayed blocks that are about to reach DELALLOC_AGE
+	time_t now = time(NULL);
+	delalloc_flush_aged(now - DELALLOC_AGE + FLUSH_INTERVAL);
+	// Step 2: Commit a transaction that is about to reach JOURNAL_COMMIT_AGE, or any
+	// transaction once the cache is filling with dirty blocks, since held blocks cannot be written back
+	int dirty = bio_dirty_ratio();
+	pthread_mutex_lock(&tx_lock);
+	int commit = tx_started != 0 && (now - tx_started >= JOURNAL_COMMIT_AGE - FLUSH_INTERVAL || dirty >= DIRTY_BACKGROUND_RATIO);
+	pthread_mutex_unlock(&tx_lock);
+	if(commit) journal_commit();
+	// Step 3: Write back the blocks about to reach BCACHE_DIRTY_AGE, or all of them
+	bio_writeback(dirty >= DIRTY_BACKGROUND_RATIO ? 0 : BCACHE_DIRTY_AGE - FLUSH_INTERVAL);
+}
+
+static void *flusher_main(void *arg) {
+	pthread_mutex_lock(&flusher_lock);
+	while(!flusher_stop){
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += FLUSH_INTERVAL;
+		while(!flusher_kick && !flusher_stop && pthread_cond_timedwait(&flusher_wake, &flusher_lock, &until) != ETIMEDOUT);
+		if(flusher_stop) break;
+		flusher_kick = 0;
+		pthread_mutex_unlock(&flusher_lock);
+		flush_pass();
+		pthread_mutex_lock(&flusher_lock);
+		flusher_passes++;
+		pthread_cond_broadcast(&flusher_done);
+	}
+	pthread_mutex_unlock(&flusher_lock);
+	return NULL;
+}
+
+static void flusher_start() {
+	flusher_stop = 0;
+	flusher_kick = 0;
+	flusher_on = pthread_create(&flusher, NULL, flusher_main, NULL) == 0;
+}
+
+static void flusher_join() {
+	if(!flusher_on) return;
+	pthread_mutex_lock(&flusher_lock);
+	flusher_stop = 1;
+	pthread_cond_broadcast(&flusher_wake);
+	pthread_cond_broadcast(&flusher_done);
+	pthread_mutex_unlock(&flusher_lock);
+	pthread_join(flusher, NULL);
+	flusher_on = 0;
+}
+
+/* 
+ * Called by writers before they start: wake the flusher early when the block
+ * cache is filling with dirty blocks, and wait for its pass when it is too full
+ */
+static void balance_dirty() {
+	int dirty = bio_dirty_ratio();
+	if(dirty < DIRTY_BACKGROUND_RATIO || !flusher_on) return;
+	pthread_mutex_lock(&flusher_lock);
+	long seen = flusher_passes;
+	flusher_kick = 1;
+	pthread_cond_signal(&flusher_wake);
+	while(dirty >= DIRTY_RATIO && flusher_passes == seen && !flusher_stop) pthread_cond_wait(&flusher_done, &flusher_lock);
+	pthread_mutex_unlock(&flusher_lock);
+}
+
+/*
+ * Low-level FUSE frontend: the kernel names files by node id and caches
+ * lookups and attributes for entry_timeout and attr_timeout seconds. FUSE
+ * reserves node id 1 for the root, which is inode 0, so a node id is always
+ * the inode number plus one. Every entry replied to lookup, mkdir or create
+ * counts as a kernel lookup until forget drops it.
+ */
+#define NODEID(ino) ((fuse_ino_t)(ino) + 1)
+#define INO(nodeid) ((uint16_t)((nodeid) - 1))
+
+/*
+ * Mount options: -o attr_timeout=T,entry_timeout=T set the kernel cache
+ * timeouts. cache_size=N sets the memory budget of the block cache in bytes,
+ * at least CACHE_SIZE_MIN. kernel_cache keeps a file's page cache across opens; auto_cache
+ * keeps it only while the file's mtime and size are what they were at the
+ * previous open. Attributes come from the inode, so both are safe.
+ */
+struct tfs_config {
+	double attr_timeout;		/* seconds the kernel may cache attributes */
+	double entry_timeout;		/* seconds the kernel may cache a name lookup */
+	int kernel_cache;			/* never drop cached file data on open */
+	int auto_cache;				/* drop cached file data on open if the file changed */
+	unsigned long cache_size;	/* block cache bytes, 0 for BCACHE_SIZE */
+};
+static struct tfs_config config = { ATTR_TIMEOUT, ENTRY_TIMEOUT, 0, 0, 0 };
+
+#define TFS_OPT(t, p) { t, offsetof(struct tfs_config, p), 1 }
+static struct fuse_opt tfs_opts[] = {
+	TFS_OPT("attr_timeout=%lf", attr_timeout),
+	TFS_OPT("entry_timeout=%lf", entry_timeout),
+	TFS_OPT("kernel_cache", kernel_cache),
+	TFS_OPT("auto_cache", auto_cache),
+	TFS_OPT("cache_size=%lu", cache_size),
+	FUSE_OPT_END
+};
+
+// mtime and size of each file when it was last opened, for auto_cache
+struct cache_stamp {
+	struct timespec mtime;
+	uint32_t size;
+};
+static struct cache_stamp cache_stamps[MAX_INUM];
+static pthread_mutex_t stamp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Whether the kernel may keep the cached data of inode i on this open
+static int keep_cache(struct inode *i) {
+	if(config.kernel_cache) return 1;
+	if(!config.auto_cache) return 0;
+	pthread_mutex_lock(&stamp_lock);
+	struct cache_stamp *c = &cache_stamps[i->ino];
+	int same = c->size == i->size && c->mtime.tv_sec == i->vstat.st_mtim.tv_sec &&
+		c->mtime.tv_nsec == i->vstat.st_mtim.tv_nsec;
+	c->mtime = i->vstat.st_mtim;
+	c->size = i->size;
+	pthread_mutex_unlock(&stamp_lock);
+	return same;
+}
+
+// Attributes of an inode as the kernel sees them
+static void fill_stat(struct inode *i, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = NODEID(i->ino);
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	if(i->type == DIR){ 
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = i->link;
 	}
-	//write dblockbmap to disk
-	for(int i = sblock->d_bitmap_blk; i < sblock->d_bitmap_blk+num_dblockbmap_blocks; i++){
-		bio_write(i, (dblockbmap+((i-sblock->d_bitmap_blk)*BLOCK_SIZE)));
+	else{
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = i->valid == 1 ? i->link : 0;
+		stbuf->st_size = i->size;
+	}
+	stbuf->st_blksize = BLOCK_SIZE;
+	stbuf->st_atim = i->vstat.st_atim;
+	stbuf->st_mtim = i->vstat.st_mtim;
+	stbuf->st_ctim = i->vstat.st_ctim;
+}
+
+// Reply with the entry of inode ino, the kernel now holds one more lookup of it
+static void reply_entry(fuse_req_t req, uint16_t ino, struct fuse_file_info *fi) {
+	struct fuse_entry_param e;
+	struct inode i;
+	memset(&e, 0, sizeof(struct fuse_entry_param));
+	readi(ino, &i);
+	e.ino = NODEID(ino);
+	e.attr_timeout = config.attr_timeout;
+	e.entry_timeout = config.entry_timeout;
+	fill_stat(&i, &e.attr);
+	if(fi != NULL) fuse_reply_create(req, &e, fi);
+	else fuse_reply_entry(req, &e);
+}
+
+/* 
+ * Lock directory ino exclusively, and check it is still a directory
+ */
+static int lock_dir(uint16_t ino, struct inode *dir) {
+	ilock(ino, 1);
+	readi(ino, dir);
+	if(dir->valid != 1 || dir->type != DIR){
+		iunlock(ino);
+		return -1;
 	}
 	return 0;
 }
 
+/*
+ * Free a file that lost its last name once the kernel has forgotten it and no
+ * open file pins it; until then it keeps its data, so open files can still
+ * read and write it. Called without a transaction or inode lock held.
+ */
+static void orphan_reclaim(uint16_t ino) {
+	// Step 1: Skip it while anything still refers to it, nothing can take a new
+	// reference to a file without a name
+	pthread_mutex_lock(&alloc_lock);
+	int busy = nlookup[ino] > 0;
+	pthread_mutex_unlock(&alloc_lock);
+	if(busy || ipinned(ino)) return;
+	// Step 2: Recheck under the inode lock, forget and release may both get here
+	struct inode i;
+	tx_begin();
+	ilock(ino, 1);
+	readi(ino, &i);
+	if(i.valid == 1 && i.type == FIL && i.link == 0){
+		// Step 3: Drop its unallocated dirty blocks and free its data blocks, including
+		// its indirect blocks, then the inode itself
+		delalloc_discard(i.ino);
+		itrunc(&i, 0);
+		i.valid = 0;
+		writei(i.ino, &i);
+		free_ino(i.ino);
+	}
+	iunlock(ino);
+	tx_end();
+}
+
 
 /* 
  * FUSE file operations
  */
-static void *tfs_init(struct fuse_conn_info *conn) {
-	//pthread_mutex_lock(&lock);
+static void tfs_init(void *userdata, struct fuse_conn_info *conn) {
+	for(int i = 0; i < MAX_INUM; i++) pthread_rwlock_init(&ilocks[i], NULL);
+	for(int i = 0; i < DELALLOC_SLOTS; i++) delalloc_tab[i].ino = -1;
+	memset(nlookup, 0, sizeof(nlookup));
+	memset(cache_stamps, 0, sizeof(cache_stamps));
+	// Ask for writes of up to MAX_WRITE bytes instead of one page per request, and for kernel
+	// readahead, and so reads, as large as that; libfuse and the kernel lower both to what they support
+	if(conn->capable & FUSE_CAP_BIG_WRITES) conn->want |= FUSE_CAP_BIG_WRITES;
+	if(conn->max_write > MAX_WRITE) conn->max_write = MAX_WRITE;
+	conn->max_readahead = MAX_WRITE;
+	// Let the kernel splice request and reply data, so file data can move between /dev/fuse and
+	// DISKFILE without a copy through our memory
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	// The block cache is sized when the disk is opened; every block a transaction writes stays in
+	// it until the commit, so it is never made smaller than CACHE_SIZE_MIN
+	if(config.cache_size > 0) bio_cache_size(config.cache_size < CACHE_SIZE_MIN ? CACHE_SIZE_MIN : config.cache_size);
 	// Step 1a: If disk file is not found, call mkfs
 	if(dev_open(diskfile_path) == -1) {
 		tfs_mkfs();
@@ -455,393 +2557,735 @@ static void *tfs_init(struct fuse_conn_info *conn) {
 		//read superblock from disk
 		sblock = malloc(BLOCK_SIZE);
 		bio_read(0, sblock);
+		//replay the journal before anything reads the metadata it may hold newer copies of;
+		//file systems made before the journal have zeroes where its fields are
+		if(sblock->j_blocks > 0 && sblock->j_start_blk + sblock->j_blocks == sblock->d_start_blk){
+			bio_journal(sblock->j_start_blk, sblock->j_blocks, 0);
+		}
+		//bitmaps are read once, with one vectored read, and kept resident until tfs_destroy
+		bitmap_io(0);
 	}
-	
-	//pthread_mutex_unlock(&lock);
-	return NULL;
+	count_free_blocks();
+	// Step 1c: Free the files that were still open when they were unlinked last time
+	for(int ino = 1; ino < MAX_INUM; ino++){
+		if(get_bitmap(inodebmap, ino)) orphan_reclaim(ino);
+	}
+	// Step 2: Start the background flusher
+	flusher_start();
 }
 
 static void tfs_destroy(void *userdata) {
 
-	// Step 1: De-allocate in-memory data structures
+	// Step 1: Stop the flusher, write out delayed blocks, commit the last transaction, and
+	// de-allocate in-memory data structures
+	flusher_join();
+	delalloc_flush_all();
+	journal_commit();
+	icache_reset();
+	dcache_reset();
 	free(inodebmap);
 	free(dblockbmap);
 	free(sblock);
-	// Step 2: Close diskfile
+	// Step 2: Close diskfile, writing back the block cache
 	dev_close();
-
+	for(int i = 0; i < MAX_INUM; i++) pthread_rwlock_destroy(&ilocks[i]);
 }
 
-static int tfs_getattr(const char *path, struct stat *stbuf) {
-	pthread_mutex_lock(&lock);
-	// Step 1: call get_node_by_path() to get inode from path
-	struct inode i;
-	if(get_node_by_path(path, 0, &i) == -1){
-		printf("didnt find %s\n", path);
-		pthread_mutex_unlock(&lock);
-		return -ENOENT;
+static void tfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	// Step 1: Hold the parent shared, so the entry cannot be removed before the kernel knows of it
+	struct inode dir;
+	size_t len = strlen(name);
+	ilock(INO(parent), 0);
+	readi(INO(parent), &dir);
+	if(dir.valid != 1 || dir.type != DIR){
+		iunlock(dir.ino);
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
-	// Step 2: fill attribute of file into stbuf from inode
-	stbuf->st_uid = getuid();
-	stbuf->st_gid = getgid();
-	if(i.type == DIR){ 
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = i.link;
+	// Step 2: Find the name in the dentry cache, or in the directory on a miss
+	int child;
+	if(!dcache_lookup(dir.ino, name, len, &child)){
+		struct dirent d;
+		child = dir_find(dir.ino, name, len, &d) == -1 ? -1 : d.ino;
+		dcache_enter(dir.ino, name, len, child);
+	}
+	// Step 3: Reply with the entry, a missing name is a negative entry the kernel caches too
+	if(child == -1){
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(struct fuse_entry_param));
+		e.entry_timeout = config.entry_timeout;
+		fuse_reply_entry(req, &e);
 	}
 	else{
-		stbuf->st_mode = S_IFREG | 0644;
-		stbuf->st_nlink = 1;
-		stbuf->st_size = i.size;
+		lookup_ref(child, 1);
+		reply_entry(req, child, NULL);
 	}
-	stbuf->st_blksize = BLOCK_SIZE;
-	time(&stbuf->st_mtime);
-	time(&stbuf->st_atime);
-	pthread_mutex_unlock(&lock);
-	return 0;
+	iunlock(dir.ino);
 }
 
-static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&lock);
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode i;
-	get_node_by_path(path, 0, &i);
-	if(i.valid == 1){
-		pthread_mutex_unlock(&lock);
-		return 0;
-	}
-	// Step 2: If not find, return -1
-	pthread_mutex_unlock(&lock);
-    return -1;
+static void tfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	// The inode may be freed, and its number handed out again, once nothing refers to it
+	lookup_ref(INO(ino), -(long)nlookup);
+	orphan_reclaim(INO(ino));
+	fuse_reply_none(req);
 }
 
-static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&lock);
-	// Step 1: Call get_node_by_path() to get inode from path
+static void tfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	// Step 1: Read the inode, a removed file that is still open reports no links
 	struct inode i;
-	get_node_by_path(path, 0, &i);
-	if(i.valid != 1){
-		printf("Directory not valid\n");
-		pthread_mutex_unlock(&lock);
-		exit(1);
-	}
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	for(int j = 0; j < 16; j++){
-		if(i.direct_ptr[j] == 0) continue;
-		struct dirent dblock[num_dirent_per_block+1];
-		bio_read(i.direct_ptr[j], dblock);
-		for(int d = 0; d < num_dirent_per_block; d++){
-			if(dblock[d]. valid == 1) filler(buffer, dblock[d].name, NULL, 0);
-		}
-	}
-	pthread_mutex_unlock(&lock);
-	return 0;
+	readi(INO(ino), &i);
+	// Step 2: fill attribute of file into stbuf from inode
+	struct stat stbuf;
+	fill_stat(&i, &stbuf);
+	fuse_reply_attr(req, &stbuf, config.attr_timeout);
 }
 
+/*
+ * An open directory keeps a snapshot of its listing in fi->fh, taken by
+ * tfs_opendir(). Readdir offsets index the snapshot, so entries that move
+ * between blocks while the directory is read are not skipped or repeated, and
+ * each call picks up where the last one stopped instead of rescanning the
+ * directory. A readdir at offset 0 after the snapshot was served, as after
+ * rewinddir(), takes a fresh one.
+ */
+struct dir_snapshot {
+	pthread_mutex_t lock;
+	struct dirent *ents;
+	int n;						/* entries in ents */
+	int cap;					/* room in ents */
+	int served;					/* a readdir has used this snapshot */
+};
 
-static int tfs_mkdir(const char *path, mode_t mode) {
-	pthread_mutex_lock(&lock);
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	char* copy1 = malloc(strlen(path)+1);
-	char* copy2 = malloc(strlen(path)+1);
-	strcpy(copy1, path);
-	strcpy(copy2, path);
-	char* bname = basename(copy1);
-	char* dname = dirname(copy2);
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode parent;
-	if(get_node_by_path(dname, 0, &parent) == -1){
-		pthread_mutex_unlock(&lock);
-		printf("Parent directory not made yet!\n");
-		exit(1);
+static int snapshot_add(struct dirent *d, void *arg) {
+	struct dir_snapshot *s = arg;
+	if(s->n == s->cap){
+		int cap = s->cap ? s->cap * 2 : 16;
+		struct dirent *ents = realloc(s->ents, cap * sizeof(struct dirent));
+		if(ents == NULL) return 1;
+		s->ents = ents;
+		s->cap = cap;
 	}
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int ino = get_avail_ino();
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	dir_add(parent, ino, bname, strlen(bname));
-	// Step 5: Update inode for target directory
-	// Step 6: Call writei() to write inode to disk
-	free(copy1);
-	free(copy2);
-	pthread_mutex_unlock(&lock);
+	s->ents[s->n++] = *d;
 	return 0;
 }
 
-static int tfs_rmdir(const char *path) {
-	pthread_mutex_lock(&lock);
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	char* copy1 = malloc(strlen(path)+1);
-	char* copy2 = malloc(strlen(path)+1);
-	strcpy(copy1, path);
-	strcpy(copy2, path);
-	char* bname = basename(copy1);
-	char* dname = dirname(copy2);
-	// Step 2: Call get_node_by_path() to get inode of target directory
-	struct inode target;
-	if(get_node_by_path(path, 0, &target) == -1){
-		printf("No target directory found to remove!\n");
-		free(copy1);
-		free(copy2);
-		pthread_mutex_unlock(&lock);
-		exit(1);
+/*
+ * Read the listing of directory ino into s, returns ENOENT if it is gone
+ */
+static int snapshot_take(fuse_ino_t ino, struct dir_snapshot *s) {
+	struct inode i;
+	ilock(INO(ino), 0);
+	readi(INO(ino), &i);
+	if(i.valid != 1 || i.type != DIR){
+		iunlock(INO(ino));
+		return i.valid == 1 ? ENOTDIR : ENOENT;
 	}
-	struct dirent dblock[num_dirent_per_block+1];
-	for(int i = 0; i < 16; i++){
-		if(target.direct_ptr[i] != 0){
-			bio_read(target.direct_ptr[i], &dblock);
-			for(int j = 0; j < num_dirent_per_block; j++){
-				if(strcmp(dblock[j].name, ".") == 0 || strcmp(dblock[j].name, "..") == 0) continue;
-				else if(dblock[j].valid == 1){
-					printf("Error: Attempting to remove non-empty directory!\n");
-					free(copy1);
-					free(copy2);
-					pthread_mutex_unlock(&lock);
-					return -1;
-				}
-			}
+	s->n = 0;
+	s->served = 0;
+	int stopped = dir_iterate(&i, snapshot_add, s);
+	iunlock(INO(ino));
+	return stopped ? ENOMEM : 0;
+}
+
+static void tfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	// Step 1: Read the listing of the directory
+	struct dir_snapshot *s = calloc(1, sizeof(struct dir_snapshot));
+	if(s == NULL){
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int err = snapshot_take(ino, s);
+	if(err){
+		// Step 2: If it is gone, return ENOENT
+		free(s->ents);
+		free(s);
+		fuse_reply_err(req, err);
+		return;
+	}
+	// Step 3: Keep it with the open directory
+	pthread_mutex_init(&s->lock, NULL);
+	fi->fh = (uintptr_t)s;
+	fuse_reply_open(req, fi);
+}
+
+static void tfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+	// Step 1: Take a fresh snapshot on a rewind
+	struct dir_snapshot *s = (struct dir_snapshot *)(uintptr_t)fi->fh;
+	pthread_mutex_lock(&s->lock);
+	if(offset == 0 && s->served){
+		int err = snapshot_take(ino, s);
+		if(err){
+			pthread_mutex_unlock(&s->lock);
+			fuse_reply_err(req, err);
+			return;
 		}
 	}
-	//read bitmaps from disk
-	for(int i = sblock->d_bitmap_blk; i < (sblock->d_bitmap_blk+num_dblockbmap_blocks); i++){
-		bio_read(i, (dblockbmap+((i-sblock->d_bitmap_blk)*BLOCK_SIZE)));
+	s->served = 1;
+	// Step 2: Copy the entries after offset until size bytes are filled, the entry
+	// at index pos is added with offset pos + 1, where the next readdir picks up
+	char *buf = malloc(size);
+	size_t used = 0;
+	for(off_t pos = offset; pos < s->n; pos++){
+		struct stat st;
+		memset(&st, 0, sizeof(struct stat));
+		st.st_ino = NODEID(s->ents[pos].ino);
+		size_t len = fuse_add_direntry(req, buf + used, size - used, s->ents[pos].name, &st, pos + 1);
+		if(len > size - used) break;
+		used += len;
+	}
+	pthread_mutex_unlock(&s->lock);
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void tfs_mkdir(fuse_req_t req, fuse_ino_t parent_id, const char *name, mode_t mode) {
+	// Step 1: Start a transaction and lock the parent directory
+	struct inode parent;
+	tx_begin();
+	if(lock_dir(INO(parent_id), &parent) == -1){
+		printf("Parent directory not made yet!\n");
+		fuse_reply_err(req, ENOENT);
+		tx_end();
+		return;
 	}
-	for(int i = sblock->i_bitmap_blk; i < (sblock->i_bitmap_blk+num_inodebmap_blocks); i++){
-		bio_read(i, (inodebmap+((i-sblock->i_bitmap_blk)*BLOCK_SIZE)));
+	// Step 2: Call get_avail_ino() to get an available inode number
+	int ino = get_avail_ino();
+	// Step 3: Call dir_add() to add directory entry of target directory to parent directory,
+	// it sets up the inode of a new directory
+	int retstat = ino == -1 ? -ENOSPC : dir_add(parent, ino, name, strlen(name));
+	if(retstat < 0){
+		if(ino != -1) free_ino(ino);
+		iunlock(parent.ino);
+		fuse_reply_err(req, -retstat);
+		tx_end();
+		return;
 	}
-	// Step 3: Clear data block bitmap of target directory
-	for(int i = 0; i < 16; i++){
-		if(target.direct_ptr[i] == 0) continue;
+	// Step 4: Reply with the new directory while the parent is still locked
+	lookup_ref(ino, 1);
+	reply_entry(req, ino, NULL);
+	iunlock(parent.ino);
+	tx_end();
+}
 
-		//clear data block
-		struct dirent dblock[num_dirent_per_block+1];
-		bio_read(target.direct_ptr[i], &dblock);
-		for(int entry = 0; entry < num_dirent_per_block; entry++) dblock[entry].valid = 0;
-		bio_write(target.direct_ptr[i], &dblock);
-		target.direct_ptr[i] = 0;
+// Directory entry other than "." and ".."
+static int not_dot(struct dirent *d, void *arg) {
+	return strcmp(d->name, ".") != 0 && strcmp(d->name, "..") != 0;
+}
 
-		//unset bitmap
-		unset_bitmap(dblockbmap, target.direct_ptr[i]-sblock->d_bitmap_blk);
-	}
-	//write data block bitmap
-	for(int i = sblock->d_bitmap_blk; i < (sblock->d_bitmap_blk+num_dblockbmap_blocks); i++){
-		bio_write(i, (dblockbmap+((i-sblock->d_bitmap_blk)*BLOCK_SIZE)));
+static void tfs_rmdir(fuse_req_t req, fuse_ino_t parent_id, const char *name) {
+	// Step 1: Start a transaction and lock the parent directory, then find and lock the target directory
+	struct inode parent, target;
+	struct dirent d;
+	size_t len = strlen(name);
+	tx_begin();
+	if(lock_dir(INO(parent_id), &parent) == -1){
+		fuse_reply_err(req, ENOENT);
+		tx_end();
+		return;
 	}
-	// Step 4: Clear inode bitmap and its data block (i cleared the data block in the previous for statement)
-	unset_bitmap(inodebmap, target.ino);
-	for(int i = sblock->i_bitmap_blk; i < (sblock->i_bitmap_blk+num_inodebmap_blocks); i++){
-		bio_write(i, (inodebmap+((i-sblock->i_bitmap_blk)*BLOCK_SIZE)));
+	if(dir_find(parent.ino, name, len, &d) == -1){
+		printf("No target directory found to remove!\n");
+		iunlock(parent.ino);
+		fuse_reply_err(req, ENOENT);
+		tx_end();
+		return;
 	}
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-	struct inode parent;
-	if(get_node_by_path(dname, 0, &parent) == -1){
-		printf("Parent directory could not be found in remove\n");
-		pthread_mutex_unlock(&lock);
-		exit(1);
+	ilock(d.ino, 1);
+	readi(d.ino, &target);
+	if(target.type != DIR || dir_iterate(&target, not_dot, NULL)){
+		printf("Error: Attempting to remove non-empty directory!\n");
+		iunlock(d.ino);
+		iunlock(parent.ino);
+		fuse_reply_err(req, target.type != DIR ? ENOTDIR : ENOTEMPTY);
+		tx_end();
+		return;
 	}
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-	if(dir_remove(parent, bname, strlen(bname)) == -1){
+	// Step 2: Clear data block bitmap of target directory
+	itrunc(&target, 0);
+	// Step 3: Clear inode bitmap
+	target.valid = 0;
+	writei(target.ino, &target);
+	dcache_purge(target.ino);
+	free_ino(target.ino);
+	iunlock(target.ino);
+	// Step 4: Call dir_remove() to remove directory entry of target directory in its parent directory
+	if(dir_remove(parent, name, len) == -1){
 		printf("Could not remove directory in remove\n");
-		pthread_mutex_unlock(&lock);
+		iunlock(parent.ino);
 		exit(1);
 	}
-	free(copy1);
-	free(copy2);
-	pthread_mutex_unlock(&lock);
-	return 0;
+	iunlock(parent.ino);
+	fuse_reply_err(req, 0);
+	tx_end();
 }
 
-static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static void tfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	// Drop the listing taken by tfs_opendir()
+	struct dir_snapshot *s = (struct dir_snapshot *)(uintptr_t)fi->fh;
+	pthread_mutex_destroy(&s->lock);
+	free(s->ents);
+	free(s);
+	fuse_reply_err(req, 0);
 }
 
-static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&lock);
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	char* copy1 = malloc(strlen(path)+1);
-	char* copy2 = malloc(strlen(path)+1);
-	strcpy(copy1, path);
-	strcpy(copy2, path);
-	char* bname = basename(copy1);
-	char* dname = dirname(copy2);
-	// Step 2: Call get_node_by_path() to get inode of parent directory
+static void tfs_create(fuse_req_t req, fuse_ino_t parent_id, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	// Step 1: Start a transaction and lock the parent directory
 	struct inode parent;
-	if(get_node_by_path(dname, 0, &parent) == -1){
+	tx_begin();
+	if(lock_dir(INO(parent_id), &parent) == -1){
 		printf("Parent directory could not be found in tfs_create\n");
-		pthread_mutex_unlock(&lock);
-		exit(1);
+		fuse_reply_err(req, ENOENT);
+		tx_end();
+		return;
 	}
-	// Step 3: Call get_avail_ino() to get an available inode number
+	// Step 2: Call get_avail_ino() to get an available inode number
 	int ino = get_avail_ino();
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	dir_add(parent, ino, bname, strlen(bname));
-	// Step 5: Update inode for target file
+	if(ino == -1){
+		iunlock(parent.ino);
+		fuse_reply_err(req, ENOSPC);
+		tx_end();
+		return;
+	}
+	// Step 3: Set up the inode for target file, a new file has no data blocks yet
 	struct inode target;
-	readi(ino, &target);
+	memset(&target, 0, sizeof(struct inode));
+	target.ino = ino;
+	target.valid = 1;
+	target.size = 0;
 	target.type = FIL;
+	target.flags = USE_EXTENTS ? EXTENT_FL : 0;
+	target.link = 1;
+	itouch(&target, 1);
+	target.vstat.st_atim = target.vstat.st_mtim;
 	writei(ino, &target);
-	struct dirent dblock[num_dirent_per_block+1];
-	bio_read(target.direct_ptr[0], &dblock);
-	memset(&dblock[1], 0, sizeof(struct dirent));
-	bio_write(target.direct_ptr[0], &dblock);
-	// Step 6: Call writei() to write inode to disk
-	//Step 5 and 6 are done in dir_add
-	free(copy1);
-	free(copy2);
-	pthread_mutex_unlock(&lock);
-	return 0;
+	// Step 4: Call dir_add() to add directory entry of target file to parent directory
+	int retstat = dir_add(parent, ino, name, strlen(name));
+	if(retstat < 0){
+		target.valid = 0;
+		writei(ino, &target);
+		free_ino(ino);
+		iunlock(parent.ino);
+		fuse_reply_err(req, -retstat);
+		tx_end();
+		return;
+	}
+	// Step 5: Open the new file and reply with it while the parent is still locked
+	//the inode was written before dir_add so it finds a valid inode
+	file_open(fi, ino);
+	lookup_ref(ino, 1);
+	reply_entry(req, ino, fi);
+	iunlock(parent.ino);
+	tx_end();
 }
 
-static int tfs_open(const char *path, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&lock);
-	// Step 1: Call get_node_by_path() to get inode from path
+static void tfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	// Step 1: Read the inode of the file
 	struct inode i;
-	if(get_node_by_path(path, 0, &i) != -1){
-		pthread_mutex_unlock(&lock);
-		return 0;
+	readi(INO(ino), &i);
+	if(i.valid == 1){
+		file_open(fi, i.ino);
+		fi->keep_cache = keep_cache(&i);
+		fuse_reply_open(req, fi);
+		return;
 	}
-	// Step 2: If not find, return -1
-	pthread_mutex_unlock(&lock);
-	return -1;
+	// Step 2: If it is gone, return ENOENT
+	fuse_reply_err(req, ENOENT);
 }
 
-static int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&lock);
-	// Step 1: You could call get_node_by_path() to get inode from path
+static void tfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+	// Step 1: Hold the inode shared
 	struct inode i;
-	if(get_node_by_path(path, 0, &i) == -1){
-		pthread_mutex_unlock(&lock);
-		return -1;
+	ilock(INO(ino), 0);
+	readi(INO(ino), &i);
+	// Step 2: Based on size and offset, read only the data blocks that overlap the request
+	if(i.valid != 1 || offset >= i.size){
+		iunlock(i.ino);
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	if(offset + size > i.size) size = i.size - offset;
+	if(size == 0){
+		iunlock(i.ino);
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	// Step 3: Let the readahead thread start on the blocks after this read
+	struct open_file *f = file_get(fi);
+	if(f != NULL) readahead(f, &i, offset, size);
+	// Step 4: map every block of the request in one pass. Dirty and mapped blocks are used in
+	// place and holes point at zeros, only blocks on the disk file need I/O
+	struct delalloc *d = delalloc_find(i.ino);
+	int first = offset / BLOCK_SIZE;
+	int nblk = (offset + size - 1) / BLOCK_SIZE - first + 1;
+	int *blknos = malloc(nblk * sizeof(int));
+	char **mem = malloc(nblk * sizeof(char *));
+	for(int k = 0; k < nblk; k++){
+		char *dirty = d != NULL ? delalloc_block(d, first + k) : NULL;
+		blknos[k] = dirty == NULL ? bmap(&i, first + k, 0) : 0;
+		if(dirty != NULL) mem[k] = dirty;
+		else if(blknos[k] <= 0) mem[k] = (char *)zero_block;
+		else mem[k] = bio_map(blknos[k]);
+	}
+	// Step 5: blocks on disk are left for the kernel to splice straight from DISKFILE, once their
+	// cached copies are written back; without that, they are read into pool buffers in one batch
+	int fd = bio_fd();
+	int *disk = malloc(nblk * sizeof(int));
+	struct bio_req *reqs = malloc(nblk * sizeof(struct bio_req));
+	int nd = 0;
+	for(int k = 0; k < nblk; k++){
+		if(mem[k] != NULL) continue;
+		if(fd == -1) mem[k] = bio_buf_get();
+		reqs[nd] = (struct bio_req){ blknos[k], mem[k], 0, 0 };
+		disk[nd++] = blknos[k];
 	}
-	// Step 2: Based on size and offset, read its data blocks from disk
-	char* temp = malloc(16*BLOCK_SIZE);
-	for(int j = 0; j < 16; j++){
-		bio_read(i.direct_ptr[j], temp+(j*BLOCK_SIZE));
+	if(fd == -1) bio_submit(reqs, nd);
+	else bio_clean(disk, nd);
+	// Step 6: reply with a piece for each run of memory, or of consecutive disk blocks
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + nblk * sizeof(struct fuse_buf));
+	bufv->count = bufv->idx = bufv->off = 0;
+	size_t done = 0;
+	for(int k = 0; k < nblk; k++){
+		int boff = (offset + done) % BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - boff;
+		if(n > size - done) n = size - done;
+		struct fuse_buf *prev = bufv->count > 0 ? &bufv->buf[bufv->count - 1] : NULL;
+		int on_disk = mem[k] == NULL;
+		if(on_disk && prev != NULL && (prev->flags & FUSE_BUF_IS_FD) && prev->pos + prev->size == (off_t)blknos[k] * BLOCK_SIZE){
+			prev->size += n;
+		}
+		else if(!on_disk && prev != NULL && !(prev->flags & FUSE_BUF_IS_FD) && (char *)prev->mem + prev->size == mem[k] + boff){
+			prev->size += n;
+		}
+		else{
+			struct fuse_buf *b = &bufv->buf[bufv->count++];
+			memset(b, 0, sizeof(struct fuse_buf));
+			b->size = n;
+			b->flags = on_disk ? FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK : 0;
+			b->mem = on_disk ? NULL : mem[k] + boff;
+			b->fd = on_disk ? fd : -1;
+			b->pos = on_disk ? (off_t)blknos[k] * BLOCK_SIZE + boff : 0;
+		}
+		done += n;
 	}
-	// Step 3: copy the correct amount of data from offset to buffer
-	strncpy(buffer, temp+offset, size);
-	// Note: this function should return the amount of bytes you copied to buffer
-	free(temp);
-	pthread_mutex_unlock(&lock);
-	return size;
+	// Note: this function should reply with the bytes you copied, the file stays locked until
+	// the reply is out so the blocks cannot change under it
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	iunlock(i.ino);
+	if(fd == -1){
+		for(int k = 0; k < nd; k++) bio_buf_put(reqs[k].buf);
+	}
+	free(bufv);
+	free(reqs);
+	free(disk);
+	free(mem);
+	free(blknos);
 }
 
-static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&lock);
-	// Step 1: You could call get_node_by_path() to get inode from path
+static void tfs_write(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi) {
+	// Step 1: Wait for the flusher if too much is dirty, then start a transaction and hold the inode exclusively
 	struct inode i;
-	if(get_node_by_path(path, 0, &i) == -1){
-		pthread_mutex_unlock(&lock);
-		return -1;
+	size_t size = fuse_buf_size(bufv);
+	balance_dirty();
+	tx_begin();
+	ilock(INO(ino), 1);
+	readi(INO(ino), &i);
+	if(i.valid != 1){
+		iunlock(i.ino);
+		fuse_reply_err(req, ENOENT);
+		tx_end();
+		return;
+	}
+	// Step 2: Split the request at block boundaries
+	size_t head = offset % BLOCK_SIZE == 0 ? 0 : BLOCK_SIZE - offset % BLOCK_SIZE;
+	if(head > size) head = size;
+	int whole = (size - head) / BLOCK_SIZE;
+	size_t tail = size - head - (size_t)whole * BLOCK_SIZE;
+	size_t done = 0;
+	char *tmp = NULL;
+	const char *src;
+	if(whole >= DELALLOC_BLOCKS && bio_fd() != -1){
+		// Step 3a: More whole blocks than a dirty slot holds go from bufv straight into DISKFILE,
+		// after the file's dirty blocks so those cannot land on top; the partial blocks around
+		// them go through delayed allocation
+		if(head > 0 && (src = buf_take(bufv, head, &tmp)) != NULL){
+			done = write_data(&i, src, head, offset);
+		}
+		if(done == head && delalloc_flush(&i) == 0){
+			done += (size_t)write_run_fd(&i, (offset + done) / BLOCK_SIZE, bufv, whole) * BLOCK_SIZE;
+		}
+		if(tail > 0 && done == size - tail && (src = buf_take(bufv, tail, &tmp)) != NULL){
+			done += write_data(&i, src, tail, offset + done);
+		}
 	}
-	// Step 2: Based on size and offset, read its data blocks from disk
-	char* temp = malloc(16*BLOCK_SIZE);
-	for(int j = 0; j < 16; j++){
-		bio_read(i.direct_ptr[j], temp+(j*BLOCK_SIZE));
+	else if((src = buf_take(bufv, size, &tmp)) != NULL){
+		// Step 3b: Copy the data into the file's dirty blocks; they are allocated when flushed
+		done = write_data(&i, src, size, offset);
 	}
-	// Step 3: Write the correct amount of data from offset to disk
-	strncpy(temp+offset, buffer, size);
-	// Step 4: Update the inode info and write it to disk
-	for(int j = 0; j < 16; j++){
-		bio_write(i.direct_ptr[j], temp+(j*BLOCK_SIZE));
+	free(tmp);
+	if(done == 0 && size > 0){
+		writei(i.ino, &i);
+		iunlock(i.ino);
+		fuse_reply_err(req, ENOSPC);
+		tx_end();
+		return;
 	}
-	// Note: this function should return the amount of bytes you write to disk
-	free(temp);
-	i.size+=size;
-	writei(i.ino, &i);
-	pthread_mutex_unlock(&lock);
-	return size;
-}
-
-static int tfs_unlink(const char *path) {
-	pthread_mutex_lock(&lock);
-	for(int i = sblock->d_bitmap_blk; i < (sblock->d_bitmap_blk+num_dblockbmap_blocks); i++){
-		bio_read(i, (dblockbmap+((i-sblock->d_bitmap_blk)*BLOCK_SIZE)));
-	}
-	for(int i = sblock->i_bitmap_blk; i < (sblock->i_bitmap_blk+num_inodebmap_blocks); i++){
-		bio_read(i, (inodebmap+((i-sblock->i_bitmap_blk)*BLOCK_SIZE)));
-	}
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	char* copy1 = malloc(strlen(path)+1);
-	char* copy2 = malloc(strlen(path)+1);
-	strcpy(copy1, path);
-	strcpy(copy2, path);
-	char* bname = basename(copy1);
-	char* dname = dirname(copy2);
-	// Step 2: Call get_node_by_path() to get inode of target file
-	struct inode i;
-	if(get_node_by_path(path, 0, &i) == -1){
-		pthread_mutex_unlock(&lock);
-		free(copy1);
-		free(copy2);
-		return ENOENT;
+	// Step 4: Update the inode info, dirty blocks that waited DELALLOC_AGE seconds go to disk with it;
+	// if they cannot be allocated they stay dirty and the write reports it
+	if(offset + done > i.size) i.size = offset + done;
+	itouch(&i, 1);
+	struct delalloc *d = delalloc_find(i.ino);
+	int retstat = 0;
+	if(d != NULL && time(NULL) - d->dirtied >= DELALLOC_AGE) retstat = delalloc_flush(&i);
+	else writei(i.ino, &i);
+	// Note: this function should reply with the bytes you write to disk
+	iunlock(i.ino);
+	if(retstat < 0) fuse_reply_err(req, -retstat);
+	else fuse_reply_write(req, done);
+	tx_end();
+}
+
+static void tfs_unlink(fuse_req_t req, fuse_ino_t parent_id, const char *name) {
+	// Step 1: Start a transaction and lock the parent directory, then find and lock the target file
+	struct inode parent, i;
+	struct dirent d;
+	size_t len = strlen(name);
+	tx_begin();
+	if(lock_dir(INO(parent_id), &parent) == -1){
+		fuse_reply_err(req, ENOENT);
+		tx_end();
+		return;
 	}
-	// Step 3: Clear data block bitmap of target file
-	for(int j = 0; j < 16; j++){
-		if(i.direct_ptr[j] <= 0) continue;
-		unset_bitmap(dblockbmap, i.direct_ptr[j]);
+	if(dir_find(parent.ino, name, len, &d) == -1){
+		iunlock(parent.ino);
+		fuse_reply_err(req, ENOENT);
+		tx_end();
+		return;
 	}
-	// Step 4: Clear inode bitmap and its data block
-	unset_bitmap(inodebmap, i.ino);
+	ilock(d.ino, 1);
+	readi(d.ino, &i);
+	// Step 2: Drop its link, the data and inode stay while the kernel or an open file
+	// still refers to it, and an open file sees when it lost its name
+	i.link = 0;
+	itouch(&i, 0);
+	writei(i.ino, &i);
+	iunlock(i.ino);
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-	struct inode parent;
-	if(get_node_by_path(dname, 0, &parent) == -1){
-		free(copy1);
-		free(copy2);
-		pthread_mutex_unlock(&lock);
-		return ENOENT;
-	}
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
-	if(dir_remove(parent, bname, strlen(bname)) == -1){
+	// Step 3: Call dir_remove() to remove directory entry of target file in its parent directory
+	if(dir_remove(parent, name, len) == -1){
 		printf("Could not remove directory in dir_remove\n");
-		free(copy1);
-		free(copy2);
-		pthread_mutex_unlock(&lock);
+		iunlock(parent.ino);
 		exit(1);
 	}
-	free(copy1);
-	free(copy2);
-	for(int i = sblock->d_bitmap_blk; i < (sblock->d_bitmap_blk+num_dblockbmap_blocks); i++){
-		bio_write(i, (dblockbmap+((i-sblock->d_bitmap_blk)*BLOCK_SIZE)));
+	iunlock(parent.ino);
+	fuse_reply_err(req, 0);
+	tx_end();
+	// Step 4: Free it now if nothing refers to it any more
+	orphan_reclaim(i.ino);
+}
+
+static int tfs_truncate(uint16_t ino, off_t size) {
+	// Step 1: Hold the inode exclusively
+	struct inode i;
+	if(size < 0) return -EINVAL;
+	if(size > UINT32_MAX) return -EFBIG;
+	ilock(ino, 1);
+	readi(ino, &i);
+	if(i.valid != 1){
+		iunlock(ino);
+		return -ENOENT;
+	}
+	if(i.type == DIR){
+		iunlock(ino);
+		return -EISDIR;
 	}
-	for(int i = sblock->i_bitmap_blk; i < (sblock->i_bitmap_blk+num_inodebmap_blocks); i++){
-		bio_write(i, (inodebmap+((i-sblock->i_bitmap_blk)*BLOCK_SIZE)));
+	// Step 2: Growing only moves the size, the new blocks are a hole
+	int nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if(size < i.size){
+		// Step 3: Drop the dirty blocks past the new end and zero the rest of the new last
+		// block, so growing the file again reads zeros there
+		delalloc_trunc(&i, nblocks);
+		int boff = size % BLOCK_SIZE;
+		if(boff != 0){
+			struct delalloc *d = delalloc_find(i.ino);
+			int dirty = d != NULL && delalloc_block(d, size / BLOCK_SIZE) != NULL;
+			if(dirty || bmap(&i, size / BLOCK_SIZE, 0) > 0){
+				write_block(&i, dirty ? d : NULL, size / BLOCK_SIZE, boff, zero_block, BLOCK_SIZE - boff);
+			}
+		}
 	}
-	pthread_mutex_unlock(&lock);
+	// Step 4: Free every block past the new end, including fallocated ones past the old size
+	itrunc(&i, nblocks);
+	if(size != i.size){
+		i.size = size;
+		itouch(&i, 1);
+	}
+	writei(ino, &i);
+	iunlock(ino);
 	return 0;
 }
 
-static int tfs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static void tfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	// Step 1: Only preallocation is supported, with or without growing the file
+	if(mode & ~FALLOC_FL_KEEP_SIZE){
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	if(offset < 0 || length <= 0){
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if(offset + length > UINT32_MAX){
+		fuse_reply_err(req, EFBIG);
+		return;
+	}
+	// Step 2: Start a transaction and hold the inode exclusively, its dirty blocks are mapped
+	// first so the holes left are the blocks to allocate
+	struct inode i;
+	tx_begin();
+	ilock(INO(ino), 1);
+	readi(INO(ino), &i);
+	if(i.valid != 1 || i.type == DIR){
+		iunlock(i.ino);
+		fuse_reply_err(req, i.valid != 1 ? ENOENT : EISDIR);
+		tx_end();
+		return;
+	}
+	if(delalloc_find(i.ino) != NULL && delalloc_flush(&i) < 0){
+		iunlock(i.ino);
+		fuse_reply_err(req, ENOSPC);
+		tx_end();
+		return;
+	}
+	// Step 3: Allocate the range up front, each hole as one run
+	int first = offset / BLOCK_SIZE;
+	int retstat = falloc_blocks(&i, first, (offset + length - 1) / BLOCK_SIZE - first + 1);
+	// Step 4: Grow the file unless asked to keep its size
+	int grow = !(mode & FALLOC_FL_KEEP_SIZE) && offset + length > i.size;
+	if(retstat == 0 && grow) i.size = offset + length;
+	itouch(&i, retstat == 0 && grow);
+	writei(i.ino, &i);
+	iunlock(i.ino);
+	fuse_reply_err(req, -retstat);
+	tx_end();
+}
+
+static void tfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	// Write out the file's delayed blocks and free the state set up by tfs_open() or tfs_create()
+	tx_begin();
+	file_sync(INO(ino));
+	tx_end();
+	struct open_file *f = file_get(fi);
+	if(f != NULL){
+		if(f->inode != NULL) iput(f->inode);
+		pthread_mutex_destroy(&f->lock);
+		free(f);
+		fi->fh = 0;
+	}
+	// A file unlinked while open is freed with its last close
+	orphan_reclaim(INO(ino));
+	fuse_reply_err(req, 0);
 }
 
-static int tfs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+static void tfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	// Allocate and write the file's delayed blocks, so close reports a full disk; making them
+	// durable is left to fsync and the background flusher
+	tx_begin();
+	int retstat = file_sync(INO(ino));
+	tx_end();
+	fuse_reply_err(req, -retstat);
+}
+
+static void tfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	// Step 1: Allocate the file's delayed blocks, then list its data blocks in file order,
+	// which is mostly disk order, and note whether its size or block map changed since the
+	// last commit; the whole step is one transaction so no commit clears that in between
+	struct inode i;
+	tx_begin();
+	int retstat = file_sync(INO(ino));
+	ilock(INO(ino), 0);
+	readi(INO(ino), &i);
+	int nblocks = i.valid == 1 ? (i.size + BLOCK_SIZE - 1) / BLOCK_SIZE : 0;
+	int *blknos = malloc((nblocks + 1) * sizeof(int));
+	int n = 0;
+	for(int lblk = 0; lblk < nblocks; lblk++){
+		int blkno = bmap(&i, lblk, 0);
+		if(blkno > 0) blknos[n++] = blkno;
+	}
+	int changed = i.valid != 1 || map_changed[i.ino];
+	iunlock(i.ino);
+	tx_end();
+	// Step 2: Write the data blocks as one batch and wait for them, so no committed inode
+	// can point at blocks that never made it to disk
+	if(bio_sync(blknos, n) < 0) retstat = -EIO;
+	free(blknos);
+	// Step 3: Then commit the inode; fdatasync skips that when only data and times changed
+	if(retstat == 0 && (!datasync || changed) && journal_commit() < 0) retstat = -EIO;
+	fuse_reply_err(req, -retstat);
+}
+
+static void tfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	// Directory blocks are metadata, committing the running transaction makes them durable
+	fuse_reply_err(req, journal_commit() < 0 ? EIO : 0);
 }
 
-static int tfs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static int tfs_utimens(uint16_t ino, const struct timespec tv[2]) {
+	// Step 1: Hold the inode exclusively
+	struct inode i;
+	ilock(ino, 1);
+	readi(ino, &i);
+	if(i.valid != 1){
+		iunlock(ino);
+		return -ENOENT;
+	}
+	// Step 2: Set atime and mtime, UTIME_NOW takes the current time and UTIME_OMIT keeps it
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct timespec *times[2] = { &i.vstat.st_atim, &i.vstat.st_mtim };
+	for(int k = 0; k < 2; k++){
+		if(tv[k].tv_nsec == UTIME_NOW) *times[k] = now;
+		else if(tv[k].tv_nsec != UTIME_OMIT) *times[k] = tv[k];
+	}
+	// Step 3: Changing the times is an inode change
+	i.vstat.st_ctim = now;
+	writei(ino, &i);
+	iunlock(ino);
+	return 0;
 }
 
-static int tfs_utimens(const char *path, const struct timespec tv[2]) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static void tfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	// Step 1: Apply the changes we support in one transaction, mode and owner are fixed
+	int retstat = 0;
+	tx_begin();
+	if(to_set & FUSE_SET_ATTR_SIZE){
+		retstat = tfs_truncate(INO(ino), attr->st_size);
+	}
+	int times = FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+	if(retstat == 0 && (to_set & times)){
+		struct timespec tv[2] = { attr->st_atim, attr->st_mtim };
+		if(!(to_set & FUSE_SET_ATTR_ATIME)) tv[0].tv_nsec = UTIME_OMIT;
+		if(to_set & FUSE_SET_ATTR_ATIME_NOW) tv[0].tv_nsec = UTIME_NOW;
+		if(!(to_set & FUSE_SET_ATTR_MTIME)) tv[1].tv_nsec = UTIME_OMIT;
+		if(to_set & FUSE_SET_ATTR_MTIME_NOW) tv[1].tv_nsec = UTIME_NOW;
+		retstat = tfs_utimens(INO(ino), tv);
+	}
+	tx_end();
+	if(retstat != 0){
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+	// Step 2: Reply with the attributes as they are now
+	tfs_getattr(req, ino, fi);
 }
 
 
-static struct fuse_operations tfs_ope = {
+static struct fuse_lowlevel_ops tfs_ope = {
 	.init		= tfs_init,
 	.destroy	= tfs_destroy,
 
+	.lookup		= tfs_lookup,
+	.forget		= tfs_forget,
 	.getattr	= tfs_getattr,
+	.setattr	= tfs_setattr,
 	.readdir	= tfs_readdir,
 	.opendir	= tfs_opendir,
 	.releasedir	= tfs_releasedir,
@@ -851,22 +3295,70 @@ static struct fuse_operations tfs_ope = {
 	.create		= tfs_create,
 	.open		= tfs_open,
 	.read 		= tfs_read,
-	.write		= tfs_write,
+	.write_buf	= tfs_write,
 	.unlink		= tfs_unlink,
+	.fallocate	= tfs_fallocate,
 
-	.truncate   = tfs_truncate,
 	.flush      = tfs_flush,
-	.utimens    = tfs_utimens,
-	.release	= tfs_release
+	.release	= tfs_release,
+	.fsync		= tfs_fsync,
+	.fsyncdir	= tfs_fsyncdir
 };
 
 
+/* 
+ * An existing DISKFILE must have been made with this on-disk format, it is
+ * never reformatted; a missing one is made by tfs_init
+ */
+static int disk_check() {
+	int fd = open(diskfile_path, O_RDONLY);
+	if(fd < 0) return errno == ENOENT ? 0 : -1;
+	uint32_t magic = 0;
+	int ok = pread(fd, &magic, sizeof(magic), offsetof(struct superblock, magic_num)) == sizeof(magic) && magic == MAGIC_NUM;
+	close(fd);
+	if(!ok) fprintf(stderr, "%s: not a file system of this version (magic %#x, expected %#x)\n", diskfile_path, magic, MAGIC_NUM);
+	return ok ? 0 : -1;
+}
+
 int main(int argc, char *argv[]) {
-	int fuse_stat;
+	int fuse_stat = 1;
+
+	// --mmap and --direct are ours, FUSE never sees them
+	int n = 1;
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "--mmap") == 0) dev_mode(DEV_MMAP);
+		else if(strcmp(argv[i], "--direct") == 0) dev_mode(DEV_DIRECT);
+		else argv[n++] = argv[i];
+	}
+	argc = n;
+	argv[argc] = NULL;
 
 	getcwd(diskfile_path, PATH_MAX);
 	strcat(diskfile_path, "/DISKFILE");
-	fuse_stat = fuse_main(argc, argv, &tfs_ope, NULL);
-	return fuse_stat;
-}
+	if(disk_check() == -1) return 1;
 
+	// Mount and serve requests the way fuse_main() would, on the low-level session
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int multithreaded, foreground;
+	if(fuse_opt_parse(&args, &config, tfs_opts, NULL) != -1 &&
+	   fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 &&
+	   (ch = fuse_mount(mountpoint, &args)) != NULL){
+		struct fuse_session *se = fuse_lowlevel_new(&args, &tfs_ope, sizeof(tfs_ope), NULL);
+		if(se != NULL){
+			if(fuse_set_signal_handlers(se) != -1){
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				fuse_stat = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+		free(mountpoint);
+	}
+	fuse_opt_free_args(&args);
+	return fuse_stat ? 1 : 0;
+}
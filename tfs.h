@@ -13,10 +13,48 @@
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
+#define MAGIC_NUM 0x5C3B			/* changes with the on-disk format, 0x5C3A had fixed size directory entries */
 #define MAX_INUM 1024
 #define MAX_DNUM 16384
 
+#define NUM_DIRECT 16							/* direct pointers in an inode */
+#define NUM_INDIRECT 7							/* single indirect pointers, indirect_ptr[7] is double indirect */
+#define PTRS_PER_BLOCK (int)(BLOCK_SIZE/sizeof(int))	/* block pointers in an indirect block */
+
+#define ICACHE_SIZE 256				/* inodes held in the in-memory inode cache */
+#define DCACHE_SIZE 1024			/* (parent, name) lookups held in the dentry cache */
+
+#ifndef USE_EXTENTS
+#define USE_EXTENTS 1				/* create regular files with extent mapping, build with -DUSE_EXTENTS=0 for block pointers */
+#endif
+#define NUM_EXTENTS 8				/* extents (or extent leaf index entries) held in an inode */
+#define EXTENTS_PER_BLOCK (int)(BLOCK_SIZE/sizeof(struct extent))
+#define PREALLOC_BLOCKS 64			/* blocks reserved ahead of a sequentially appended file */
+#define PREALLOC_SLOTS 32			/* files that can hold a preallocation window at once */
+#define READ_BATCH 16				/* directory blocks dir_iterate() reads with one bio_readv() */
+#define MAX_WRITE (1024*1024)		/* largest FUSE write, and readahead, asked for in tfs_init */
+#define RA_MIN_BLOCKS 4				/* readahead window once a file is read sequentially */
+#define RA_MAX_BLOCKS 128			/* largest readahead window */
+#define DELALLOC_SLOTS 32			/* files that can hold dirty data not allocated yet */
+#define DELALLOC_BLOCKS 32			/* dirty blocks a file buffers before they are allocated */
+#define DELALLOC_AGE 5				/* seconds dirty file data may wait for allocation */
+#define ENTRY_TIMEOUT 60.0			/* default seconds the kernel may cache a name lookup, -o entry_timeout */
+#define ATTR_TIMEOUT 60.0			/* default seconds the kernel may cache inode attributes, -o attr_timeout */
+#define CACHE_SIZE_MIN (4*JOURNAL_TX_BLOCKS*BLOCK_SIZE)	/* smallest block cache -o cache_size gives, a transaction's blocks stay cached */
+#define JOURNAL_BLOCKS 256			/* blocks of the metadata journal made by tfs_mkfs() */
+#define JOURNAL_TX_BLOCKS 64		/* metadata blocks a transaction may hold before it is committed */
+#define JOURNAL_COMMIT_AGE 5		/* seconds a transaction may stay open */
+#define FLUSH_INTERVAL 1			/* seconds between passes of the background flusher */
+#define DIRTY_BACKGROUND_RATIO 10	/* percent of the block cache dirty that has the flusher write back everything */
+#define DIRTY_RATIO 40				/* percent of the block cache dirty at which writers wait for the flusher */
+
+/* inode flags */
+#define EXTENT_FL		0x1			/* blocks are mapped by extents instead of block pointers */
+#define EXTENT_IDX_FL	0x2			/* inode extents index extent leaf blocks */
+#define DIR_INDEX_FL	0x4			/* directory has a hashed index in its first block */
+
+#define DIR_INDEX_THRESHOLD 4		/* blocks a linear directory may use before it is indexed */
+
 
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
@@ -26,17 +64,31 @@ struct superblock {
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	j_start_blk;		/* start block of the metadata journal */
+	uint32_t	j_blocks;			/* blocks in the journal, 0 for none */
+};
+
+struct extent {
+	uint32_t	lblk;				/* first file block covered by the extent */
+	uint32_t	len;				/* number of blocks, or extents in the leaf for an index entry */
+	int			start;				/* first data block, or the leaf block for an index entry */
 };
 
 struct inode {
 	uint16_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
 	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
+	uint16_t	type;				/* type of the file */
+	uint16_t	flags;				/* inode flags */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
-	struct stat	vstat;				/* inode stat */
+	union {
+		struct {
+			int		direct_ptr[16];		/* direct pointer to data block */
+			int		indirect_ptr[8];	/* indirect pointer to data block, [7] is double indirect */
+		};
+		struct extent extents[NUM_EXTENTS];	/* extent map when EXTENT_FL is set */
+	};
+	struct stat	vstat;				/* inode stat, keeps st_atim, st_mtim and st_ctim */
 };
 
 struct dirent {
@@ -46,6 +98,33 @@ struct dirent {
 	uint16_t len;					/* length of name */
 };
 
+/*
+ * On-disk directory entry: records are packed from the start of the block and
+ * the last one's rec_len runs to the end of the block, so free space is at the end.
+ */
+struct dirent_rec {
+	uint16_t ino;					/* inode number of the directory entry */
+	uint16_t rec_len;				/* bytes from this record to the next one */
+	uint16_t name_len;				/* length of name, 0 for an unused record */
+	char name[];					/* name, not NUL terminated */
+};
+
+#define DIRENT_REC_LEN(len) (int)((sizeof(struct dirent_rec) + (len) + 3) & ~3)
+
+struct dx_entry {
+	uint32_t hash;					/* lowest name hash stored in the leaf */
+	uint32_t lblk;					/* directory block of the leaf */
+};
+
+#define DX_ENTRIES (int)((BLOCK_SIZE-8)/sizeof(struct dx_entry))
+
+struct dx_root {
+	uint16_t dot;					/* inode number of "." */
+	uint16_t dotdot;				/* inode number of ".." */
+	uint32_t count;					/* index entries in use */
+	struct dx_entry entries[DX_ENTRIES];	/* leaves sorted by hash, entries[0].hash is 0 */
+};
+
 
 /*
  * bitmap operations
@@ -64,4 +143,25 @@ uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
+/*
+ * Find the first clear bit at or after 'start' (wrapping around) among the
+ * first nbits bits, scanning 64 bits at a time. The bitmap buffer must be
+ * 8-byte aligned and padded to a multiple of 8 bytes. Returns -1 if full.
+ */
+int find_zero_bitmap(bitmap_t b, int nbits, int start) {
+	uint64_t *w = (uint64_t *)b;
+	int nwords = (nbits + 63) / 64;
+	if (start >= nbits) start = 0;
+	int first = start / 64;
+	for (int n = 0; n <= nwords; n++) {
+		int k = (first + n) % nwords;
+		uint64_t free_bits = ~w[k];
+		if (n == 0) free_bits &= ~0ULL << (start & 63);
+		if (free_bits == 0) continue;
+		int i = k * 64 + __builtin_ctzll(free_bits);
+		if (i < nbits) return i;
+	}
+	return -1;
+}
+
 #endif